@@ -1,57 +1,180 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <stdexcept>
 #include <thread>
 #include <vector>
 
+// Work-stealing pool. Every worker owns a deque kept sorted by estimated cost,
+// largest first; new jobs go to the least loaded deque and idle workers steal
+// the largest job of the most loaded one, so big jobs start as early as
+// possible and small ones fill the tail.
 class ThreadPool {
  public:
-  ThreadPool(size_t);
+  // start, if given, runs first on every worker with its index
+  ThreadPool(size_t, std::function<void(size_t)> start = nullptr);
+  // queue a job whose run time is expected to grow with cost
+  template <class F>
+  void submit(size_t cost, F&& f);
   template <class F, class... Args>
   auto enqueue(F&& f, Args&&... args)
       -> std::future<typename std::result_of<F(Args...)>::type>;
+  // block until every submitted job has finished
+  void wait();
+  // same as wait, but gives up after timeout; returns true when idle
+  template <class Rep, class Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& timeout);
+  size_t pending() const { return unfinished; }
+  size_t size() const { return workers.size(); }
+  // index of the calling worker, -1 outside of any pool
+  static int worker_index() { return current_worker(); }
   ~ThreadPool();
 
  private:
+  struct Job {
+    size_t cost;
+    std::function<void()> run;
+  };
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+    size_t cost = 0;
+  };
+
+  static int& current_worker() {
+    thread_local int index = -1;
+    return index;
+  }
+  bool pop(size_t index, Job& job);
+  bool steal(size_t index, Job& job);
+  void finished();
+
   // need to keep track of threads so we can join them
   std::vector<std::thread> workers;
-  // the task queue
-  std::queue<std::function<void()> > tasks;
+  // one queue per worker
+  std::vector<std::unique_ptr<Queue> > queues;
 
   // synchronization
-  std::mutex queue_mutex;
+  std::mutex state_mutex;
   std::condition_variable condition;
+  std::condition_variable done;
+  size_t queued;
+  std::atomic<size_t> unfinished;
   bool stop;
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
+inline ThreadPool::ThreadPool(size_t threads,
+                              std::function<void(size_t)> start)
+    : queued(0), unfinished(0), stop(false) {
+  for (size_t i = 0; i < threads; ++i) queues.emplace_back(new Queue);
   for (size_t i = 0; i < threads; ++i)
-    workers.emplace_back([this] {
+    workers.emplace_back([this, i, start] {
+      current_worker() = int(i);
+      if (start) start(i);
       for (;;) {
-        std::function<void()> task;
-
-        {
-          std::unique_lock<std::mutex> lock(this->queue_mutex);
-          this->condition.wait(
-              lock, [this] { return this->stop || !this->tasks.empty(); });
-          if (this->stop && this->tasks.empty()) return;
-          task = std::move(this->tasks.front());
-          this->tasks.pop();
+        Job job;
+        if (pop(i, job) || steal(i, job)) {
+          job.run();
+          finished();
+          continue;
         }
 
-        task();
+        std::unique_lock<std::mutex> lock(this->state_mutex);
+        this->condition.wait(lock,
+                             [this] { return this->stop || this->queued; });
+        if (this->stop && !this->queued) return;
       }
     });
 }
 
+inline bool ThreadPool::pop(size_t index, Job& job) {
+  Queue& queue = *queues[index];
+  {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    if (queue.jobs.empty()) return false;
+    job = std::move(queue.jobs.front());
+    queue.jobs.pop_front();
+    queue.cost -= job.cost;
+  }
+  std::unique_lock<std::mutex> lock(state_mutex);
+  queued--;
+  return true;
+}
+
+inline bool ThreadPool::steal(size_t index, Job& job) {
+  for (;;) {
+    size_t victim = index;
+    size_t victim_cost = 0;
+    bool found = false;
+    for (size_t i = 0; i < queues.size(); ++i) {
+      std::unique_lock<std::mutex> lock(queues[i]->mutex);
+      if (!queues[i]->jobs.empty() &&
+          (!found || queues[i]->cost > victim_cost)) {
+        victim = i;
+        victim_cost = queues[i]->cost;
+        found = true;
+      }
+    }
+    if (!found) return false;
+    // the victim may have drained its queue in the meantime, so look again
+    if (pop(victim, job)) return true;
+  }
+}
+
+inline void ThreadPool::finished() {
+  if (--unfinished == 0) {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    done.notify_all();
+  }
+}
+
+template <class F>
+void ThreadPool::submit(size_t cost, F&& f) {
+  {
+    std::unique_lock<std::mutex> lock(state_mutex);
+
+    // don't allow enqueueing after stopping the pool
+    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+  }
+
+  // pick the deque with the least pending work
+  size_t target = 0;
+  size_t target_cost = 0;
+  for (size_t i = 0; i < queues.size(); ++i) {
+    std::unique_lock<std::mutex> lock(queues[i]->mutex);
+    if (i == 0 || queues[i]->cost < target_cost) {
+      target = i;
+      target_cost = queues[i]->cost;
+    }
+  }
+
+  // counted before it is published, or a worker could pop the job and
+  // decrement queued first
+  unfinished++;
+  {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    queued++;
+  }
+  {
+    Queue& queue = *queues[target];
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    auto it = queue.jobs.begin();
+    while (it != queue.jobs.end() && it->cost >= cost) ++it;
+    queue.jobs.insert(it, Job{cost, std::forward<F>(f)});
+    queue.cost += cost;
+  }
+  condition.notify_one();
+}
+
 // add new work item to the pool
 template <class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
@@ -62,26 +185,61 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
       std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
   std::future<return_type> res = task->get_future();
-  {
-    std::unique_lock<std::mutex> lock(queue_mutex);
+  submit(0, [task]() { (*task)(); });
+  return res;
+}
 
-    // don't allow enqueueing after stopping the pool
-    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+inline void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(state_mutex);
+  done.wait(lock, [this] { return unfinished == 0; });
+}
 
-    tasks.emplace([task]() { (*task)(); });
-  }
-  condition.notify_one();
-  return res;
+template <class Rep, class Period>
+bool ThreadPool::wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+  std::unique_lock<std::mutex> lock(state_mutex);
+  return done.wait_for(lock, timeout, [this] { return unfinished == 0; });
 }
 
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool() {
   {
-    std::unique_lock<std::mutex> lock(queue_mutex);
+    std::unique_lock<std::mutex> lock(state_mutex);
     stop = true;
   }
   condition.notify_all();
   for (std::thread& worker : workers) worker.join();
 }
 
+// Jobs of one client of a shared pool, so the client can wait for its own
+// jobs without waiting for everybody else's
+class JobGroup {
+ public:
+  explicit JobGroup(ThreadPool& pool) : pool(pool), unfinished(0) {}
+  ~JobGroup() { wait(); }
+
+  template <class F>
+  void submit(size_t cost, F&& f) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      unfinished++;
+    }
+    pool.submit(cost, [this, f = std::forward<F>(f)]() mutable {
+      f();
+      std::unique_lock<std::mutex> lock(mutex);
+      if (--unfinished == 0) done.notify_all();
+    });
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return unfinished == 0; });
+  }
+
+ private:
+  ThreadPool& pool;
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t unfinished;
+};
+
 #endif
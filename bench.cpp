@@ -0,0 +1,499 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "byteorder.h"
+#include "codec.h"
+#include "cpu.h"
+#include "crc.h"
+#include "findtable.h"
+#include "match.h"
+#include "readwrite.h"
+#include "rom.h"
+#include "yaz0.h"
+
+// Benchmarks for the Yaz0 encoder and decoder, the other formats, the worker
+// pool and the ROM helpers on a synthetic
+// corpus, optionally followed by a real ROM. Results are printed as JSON.
+
+struct Corpus {
+  std::string name;
+  std::vector<uint8_t> data;
+};
+
+std::vector<uint8_t> make_text(size_t size, std::mt19937& rng) {
+  static const char* words[] = {
+      "Link",   "Zelda",   "Ganondorf", "Hyrule", "the",    "of",
+      "Time",   "Ocarina", "Master",    "Sword",  "Rupees", "Kokiri",
+      "Forest", "Temple",  "you",       "got",    "a",      "Heart"};
+  std::vector<uint8_t> result;
+  while (result.size() < size) {
+    const char* word = words[rng() % (sizeof(words) / sizeof(*words))];
+    result.insert(result.end(), word, word + strlen(word));
+    result.push_back(rng() % 8 ? ' ' : (rng() % 2 ? '\n' : '!'));
+  }
+  result.resize(size);
+  return result;
+}
+
+std::vector<uint8_t> make_random(size_t size, std::mt19937& rng) {
+  std::vector<uint8_t> result(size);
+  for (auto& byte : result) byte = rng();
+  return result;
+}
+
+// F3DEX2-like command lists interleaved with vertex blocks
+std::vector<uint8_t> make_display_list(size_t size, std::mt19937& rng) {
+  static const uint8_t opcodes[] = {0x01, 0x05, 0x06, 0xD7, 0xD9, 0xDA,
+                                    0xDE, 0xE7, 0xFA, 0xFC, 0xFD, 0xDF};
+  std::vector<uint8_t> result(size);
+  size_t pos = 0;
+  while (pos + 16 <= size) {
+    if (rng() % 4 == 0) {
+      // a vertex: position, flag, texture coordinates, color
+      int16_t x = rng() % 2048 - 1024, y = rng() % 512, z = rng() % 2048;
+      W32(&result[pos], uint32_t(uint16_t(x)) << 16 | uint16_t(y));
+      W32(&result[pos + 4], uint32_t(uint16_t(z)) << 16);
+      W32(&result[pos + 8], (rng() % 64) << 22 | (rng() % 64) << 6);
+      W32(&result[pos + 12], 0xFFFFFF00 | (rng() % 2 ? 0xFF : 0x80));
+      pos += 16;
+    } else {
+      uint8_t op = opcodes[rng() % sizeof(opcodes)];
+      W32(&result[pos], uint32_t(op) << 24 | (rng() % 32) << 1);
+      W32(&result[pos + 4], 0x06000000 | (rng() % 0x800) << 3);
+      pos += 8;
+    }
+  }
+  return result;
+}
+
+// RGBA16 gradients and palette indexed tiles
+std::vector<uint8_t> make_texture(size_t size, std::mt19937& rng) {
+  std::vector<uint8_t> result(size);
+  size_t pos = 0;
+  while (pos < size) {
+    size_t tile = std::min<size_t>(32 * 32 * 2, size - pos);
+    int kind = rng() % 3;
+    uint32_t base = rng();
+    for (size_t i = 0; i < tile; i += 2) {
+      uint16_t pixel;
+      size_t x = (i / 2) % 32, y = (i / 2) / 32;
+      if (kind == 0) {
+        pixel = uint16_t(((x + (base & 7)) << 11) | (y << 6) | 1);
+      } else if (kind == 1) {
+        pixel = uint16_t(((x / 4 + y / 4 + base) % 4) * 0x1111);
+      } else {
+        pixel = uint16_t(base >> ((rng() % 2) * 16)) | (rng() % 16 == 0);
+      }
+      result[pos + i] = pixel >> 8;
+      if (i + 1 < tile) result[pos + i + 1] = pixel & 0xFF;
+    }
+    pos += tile;
+  }
+  return result;
+}
+
+// Forces the CRC32 of the boot code to value by rewriting its last four
+// bytes, so that fix_crc detects a CIC and checksums the full MB.
+void force_boot_code_crc(uint8_t* rom, uint32_t value) {
+  uint32_t table[256];
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    table[i] = crc;
+  }
+
+  uint8_t* boot = rom + 0x40;
+  const size_t size = 0x1000 - 0x40;
+  uint32_t state = ~0u;
+  for (size_t i = 0; i < size - 4; i++) {
+    state = (state >> 8) ^ table[(state ^ boot[i]) & 0xFF];
+  }
+
+  // walk the last four steps backwards from the wanted final state
+  uint32_t target = ~value;
+  for (int i = 0; i < 4; i++) {
+    uint32_t j = 0;
+    while ((table[j] >> 24) != (target >> 24)) j++;
+    target = ((target ^ table[j]) << 8) | j;
+  }
+  uint32_t patch = target ^ state;
+  for (int i = 0; i < 4; i++) boot[size - 4 + i] = patch >> (8 * i);
+}
+
+// An image with a CIC-6102 boot code and a file table where findTable
+// expects it
+std::vector<uint8_t> make_rom(size_t size, std::mt19937& rng) {
+  std::vector<uint8_t> rom = make_random(size, rng);
+  W32(&rom[0], 0x80371240);
+  force_boot_code_crc(rom.data(), 0x90BB6CB5);
+
+  const size_t table = 0x7430;
+  memcpy(&rom[table - 0x20], "zelda@srd", 9);
+  memset(&rom[table - 0x17], 0, 0x17);
+  W32(&rom[table], 0);
+  W32(&rom[table + 4], 0x1060);
+  return rom;
+}
+
+struct Result {
+  std::string name;
+  std::string variant;
+  std::string corpus;
+  size_t bytes;
+  double seconds;
+  double ratio;
+};
+
+std::vector<Result> results;
+int repeat = 3;
+
+// best of repeat runs
+double measure(const std::function<void()>& fn) {
+  double best = 1e30;
+  for (int i = 0; i < repeat; i++) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+void record(const std::string& name, const std::string& variant,
+            const std::string& corpus, size_t bytes, double seconds,
+            double ratio = 0) {
+  results.push_back({name, variant, corpus, bytes, seconds, ratio});
+  fprintf(stderr, "%-12s %-12s %-14s %8.1f MB/s", name.c_str(),
+          variant.c_str(), corpus.c_str(), bytes / seconds / 1e6);
+  if (ratio) fprintf(stderr, "  ratio %.4f", ratio);
+  fprintf(stderr, "\n");
+}
+
+void bench_codec(const Corpus& corpus, size_t brute_limit) {
+  struct Finder {
+    const char* name;
+    Yaz0MatchFinder finder;
+  } finders[] = {{"brute", Yaz0MatchFinder::brute},
+                 {"rabinkarp", Yaz0MatchFinder::rabinkarp},
+                 {"hash_chain", Yaz0MatchFinder::hash_chain}};
+
+  std::vector<uint8_t> encoded;
+  for (const Finder& finder : finders) {
+    // the window scans are too slow for the full corpus
+    size_t size = corpus.data.size();
+    if (finder.finder != Yaz0MatchFinder::hash_chain) {
+      size = std::min(size, brute_limit);
+    }
+    double seconds = measure([&] {
+      encoded = yaz0_encode(corpus.data.data(), size, finder.finder);
+    });
+    record("encode", finder.name, corpus.name, size, seconds,
+           double(encoded.size()) / size);
+  }
+
+  std::vector<uint8_t> decoded(corpus.data.size());
+  double seconds = measure([&] {
+    yaz0_decode(encoded.data(), decoded.data(), decoded.size());
+  });
+  record("decode", "reference", corpus.name, decoded.size(), seconds);
+  seconds = measure([&] {
+    if (!yaz0_decode_checked(encoded.data(), encoded.size(), decoded.data(),
+                             decoded.size())) {
+      fprintf(stderr, "Error: decoding %s failed\n", corpus.name.c_str());
+      exit(1);
+    }
+  });
+  record("decode", "checked", corpus.name, decoded.size(), seconds);
+  if (decoded != corpus.data) {
+    fprintf(stderr, "Error: %s does not round-trip\n", corpus.name.c_str());
+    exit(1);
+  }
+
+  // fed in 64 KB chunks, as from a file or socket
+  Yaz0Decoder decoder;
+  seconds = measure([&] {
+    decoder.reset();
+    uint8_t* out = decoded.data();
+    for (size_t pos = 0; pos < encoded.size(); pos += 0x10000) {
+      size_t chunk = std::min<size_t>(0x10000, encoded.size() - pos);
+      decoder.feed(encoded.data() + pos, chunk,
+                   [&](const uint8_t* data, size_t size) {
+                     memcpy(out, data, size);
+                     out += size;
+                   });
+    }
+  });
+  record("decode", "stream", corpus.name, decoded.size(), seconds);
+  if (!decoder.finished() || decoded != corpus.data) {
+    fprintf(stderr, "Error: %s does not round-trip in chunks\n",
+            corpus.name.c_str());
+    exit(1);
+  }
+}
+
+// every format on the same data through the common interface, so encode and
+// decode speed and ratio compare directly
+void bench_formats(const Corpus& corpus) {
+  std::vector<uint8_t> encoded;
+  std::vector<uint8_t> decoded(corpus.data.size());
+  for (Format format : {Format::yaz0, Format::yay0, Format::mio0}) {
+    std::unique_ptr<Codec> codec = Codec::create(format);
+    encoded.resize(codec->bound(corpus.data.size()));
+    size_t encoded_size = 0;
+    double seconds = measure([&] {
+      encoded_size =
+          codec->encode(corpus.data.data(), corpus.data.size(), encoded.data());
+    });
+    record("format_encode", format_name(format), corpus.name,
+           corpus.data.size(), seconds,
+           double(encoded_size) / corpus.data.size());
+
+    seconds = measure([&] {
+      if (!codec->decode(encoded.data(), encoded_size, decoded.data(),
+                         decoded.size())) {
+        fprintf(stderr, "Error: decoding %s as %s failed\n",
+                corpus.name.c_str(), format_name(format));
+        exit(1);
+      }
+    });
+    record("format_decode", format_name(format), corpus.name, decoded.size(),
+           seconds);
+    if (decoded != corpus.data) {
+      fprintf(stderr, "Error: %s does not round-trip as %s\n",
+              corpus.name.c_str(), format_name(format));
+      exit(1);
+    }
+  }
+}
+
+// speed and ratio of every compression level, Yaz0 standing in for all
+// formats since they share the parsers
+void bench_levels(const Corpus& corpus) {
+  std::vector<uint8_t> encoded;
+  std::vector<uint8_t> decoded(corpus.data.size());
+  for (int level = 0; level <= CODEC_MAX_LEVEL; level++) {
+    std::unique_ptr<Codec> codec = Codec::create(Format::yaz0, level);
+    encoded.resize(codec->bound(corpus.data.size()));
+    size_t encoded_size = 0;
+    double seconds = measure([&] {
+      encoded_size =
+          codec->encode(corpus.data.data(), corpus.data.size(), encoded.data());
+    });
+    std::string variant = "level" + std::to_string(level);
+    record("level_encode", variant, corpus.name, corpus.data.size(), seconds,
+           double(encoded_size) / corpus.data.size());
+
+    if (!codec->decode(encoded.data(), encoded_size, decoded.data(),
+                       decoded.size()) ||
+        decoded != corpus.data) {
+      fprintf(stderr, "Error: %s does not round-trip at level %d\n",
+              corpus.name.c_str(), level);
+      exit(1);
+    }
+  }
+}
+
+// Every corpus in 64 KB jobs on a worker pool, with one thread per CPU the
+// process can actually run on and oversubscribed beyond that. Under a cgroup
+// quota the extra threads only add throttling.
+void bench_threads(const std::vector<Corpus>& corpora) {
+  CpuLimits limits = cpu_limits();
+  int cpus = limits.allowed ? limits.allowed : std::max(limits.online, 1);
+  if (limits.quota > 0 && limits.quota < cpus) {
+    cpus = std::max(1, int(std::ceil(limits.quota)));
+  }
+  std::string reason;
+  int count = cpu_count(limits, &reason);
+  fprintf(stderr, "%d CPU%s to run on, cpu_count picks %d threads (%s)\n",
+          cpus, cpus == 1 ? "" : "s", count, reason.c_str());
+
+  size_t bytes = 0;
+  for (const Corpus& corpus : corpora) bytes += corpus.data.size();
+  for (int threads : {cpus, cpus + 2, 4 * cpus}) {
+    ThreadPool pool(threads);
+    std::atomic<size_t> encoded(0);
+    double seconds = measure([&] {
+      encoded = 0;
+      for (const Corpus& corpus : corpora) {
+        for (size_t pos = 0; pos < corpus.data.size(); pos += 0x10000) {
+          size_t size = std::min<size_t>(0x10000, corpus.data.size() - pos);
+          pool.submit(size, [&corpus, &encoded, pos, size] {
+            thread_local std::unique_ptr<Codec> codec =
+                Codec::create(Format::yaz0);
+            thread_local std::vector<uint8_t> out;
+            out.resize(codec->bound(size));
+            encoded +=
+                codec->encode(corpus.data.data() + pos, size, out.data());
+          });
+        }
+      }
+      pool.wait();
+    });
+    record("pool_encode", std::to_string(threads) + "_threads", "all", bytes,
+           seconds, double(encoded) / bytes);
+  }
+}
+
+void bench_rom_helpers(std::vector<uint8_t>& rom, const std::string& corpus) {
+  double seconds = measure([&] { fix_crc(rom.data(), rom.size()); });
+  record("fix_crc", "default", corpus, 0x101000, seconds);
+  bool valid = false;
+  seconds = measure([&] { valid = verify_crc(rom.data(), rom.size()); });
+  record("verify_crc", "default", corpus, 0x101000, seconds);
+  if (!valid) {
+    fprintf(stderr, "Error: checksum of %s does not verify\n", corpus.c_str());
+    exit(1);
+  }
+
+  // every conversion is its own inverse, so an even number of them restores
+  // the image for the benchmarks after this one
+  for (ByteOrder order : {ByteOrder::swapped, ByteOrder::little}) {
+    seconds =
+        measure([&] { convert_byte_order(rom.data(), rom.size(), order); });
+    if (repeat % 2) convert_byte_order(rom.data(), rom.size(), order);
+    record("byte_order", byte_order_name(order), corpus, rom.size(), seconds);
+  }
+
+  size_t position = 0;
+  seconds = measure([&] { findTable(rom.data(), rom.size(), &position); });
+  record("find_table", "known", corpus, position, seconds);
+  seconds = measure([&] { scanTable(rom.data(), rom.size(), &position); });
+  record("find_table", "scan", corpus, position, seconds);
+}
+
+void bench_rom(const std::string& path) {
+  N64ROM rom(path);
+  size_t encoded_bytes = 0, encoded_input = 0;
+  size_t decoded_bytes = 0;
+  double encode_seconds = 0, decode_seconds = 0;
+  std::vector<uint8_t> scratch;
+  Yaz0Encoder encoder;
+
+  for (size_t i = 3; i < rom.entry_count(); i++) {
+    const auto& entry = rom.inEntry(i);
+    if (!entry.endV || entry.endV < entry.startV) continue;
+    const uint8_t* data = rom.in().data() + entry.startP;
+    auto start = std::chrono::steady_clock::now();
+    if (entry.is_compressed()) {
+      scratch.resize(entry.size());
+      yaz0_decode_checked(data, entry.endP - entry.startP, scratch.data(),
+                          scratch.size());
+      decoded_bytes += entry.size();
+      decode_seconds += std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    } else {
+      scratch.resize(yaz0_bound(entry.size()));
+      encoded_bytes += encoder.encode(data, entry.size(), scratch.data());
+      encoded_input += entry.size();
+      encode_seconds += std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    }
+  }
+  if (encoded_input) {
+    record("encode", "hash_chain", "rom", encoded_input, encode_seconds,
+           double(encoded_bytes) / encoded_input);
+  }
+  if (decoded_bytes) {
+    record("decode", "checked", "rom", decoded_bytes, decode_seconds);
+  }
+
+  std::vector<uint8_t> image(rom.in().begin(), rom.in().end());
+  bench_rom_helpers(image, "rom");
+}
+
+void print_json() {
+  printf("{\n  \"encoder_version\": %d,\n  \"simd\": \"%s\",\n",
+         YAZ0_ENCODER_VERSION, simd_level_name(simd_level()));
+  printf("  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& r = results[i];
+    printf("    {\"name\": \"%s\", \"variant\": \"%s\", \"corpus\": \"%s\", "
+           "\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f",
+           r.name.c_str(), r.variant.c_str(), r.corpus.c_str(), r.bytes,
+           r.seconds, r.bytes / r.seconds / 1e6);
+    if (r.ratio) printf(", \"ratio\": %.6f", r.ratio);
+    printf("}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --size BYTES    size of each synthetic corpus (default 1 MB)\n"
+          "  --brute BYTES   how much of each corpus the window scans encode\n"
+          "  --repeat N      runs per measurement, the best one is kept\n"
+          "  --simd LEVEL    scalar, sse2, sse4.2 or avx2\n"
+          "  --rom FILE      also benchmark a real ROM\n",
+          argv0);
+}
+
+int main(int argc, char** argv) {
+  size_t size = 1 << 20;
+  size_t brute_limit = 1 << 18;
+  std::string rom_path;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--size" && has_value) {
+      size = strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "--brute" && has_value) {
+      brute_limit = strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "--repeat" && has_value) {
+      repeat = atoi(argv[++i]);
+    } else if (arg == "--rom" && has_value) {
+      rom_path = argv[++i];
+    } else if (arg == "--simd" && has_value) {
+      std::string name = argv[++i];
+      bool selected = false;
+      for (SimdLevel level : {SimdLevel::scalar, SimdLevel::sse2,
+                              SimdLevel::sse42, SimdLevel::avx2}) {
+        if (name == simd_level_name(level)) selected = simd_select(level);
+      }
+      if (!selected) {
+        fprintf(stderr, "SIMD level %s is not available\n", name.c_str());
+        return 1;
+      }
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (repeat < 1) repeat = 1;
+
+  std::mt19937 rng(0x5A3D);
+  std::vector<Corpus> corpora = {
+      {"text", make_text(size, rng)},
+      {"zero", std::vector<uint8_t>(size)},
+      {"random", make_random(size, rng)},
+      {"display_list", make_display_list(size, rng)},
+      {"texture", make_texture(size, rng)},
+  };
+  for (const Corpus& corpus : corpora) bench_codec(corpus, brute_limit);
+  for (const Corpus& corpus : corpora) bench_formats(corpus);
+  for (const Corpus& corpus : corpora) bench_levels(corpus);
+  bench_threads(corpora);
+
+  std::vector<uint8_t> rom = make_rom(0x200000, rng);
+  bench_rom_helpers(rom, "synthetic_rom");
+
+  if (!rom_path.empty()) bench_rom(rom_path);
+
+  print_json();
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include "buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Buffer::Buffer(Buffer&& other) noexcept { *this = std::move(other); }
+
+Buffer& Buffer::operator=(Buffer&& other) noexcept {
+  if (this != &other) {
+    release();
+    ptr = std::exchange(other.ptr, nullptr);
+    length = std::exchange(other.length, 0);
+    capacity = std::exchange(other.capacity, 0);
+    mapped = std::exchange(other.mapped, false);
+  }
+  return *this;
+}
+
+Buffer::~Buffer() { release(); }
+
+void Buffer::release() {
+  if (!ptr) return;
+#ifndef _WIN32
+  if (mapped) {
+    munmap(ptr, capacity);
+  } else
+#endif
+  {
+    free(ptr);
+  }
+  ptr = nullptr;
+  length = capacity = 0;
+}
+
+Buffer Buffer::map_file(const std::string& name) {
+  Buffer buffer;
+  if (!map_file(name, buffer)) exit(1);
+  return buffer;
+}
+
+bool Buffer::map_file(const std::string& name, Buffer& buffer) {
+  buffer = Buffer();
+#ifndef _WIN32
+  int fd = open(name.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(name.c_str());
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  if (st.st_size > 0) {
+    void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+    if (p == MAP_FAILED) {
+      perror(name.c_str());
+      close(fd);
+      return false;
+    }
+    buffer.ptr = static_cast<uint8_t*>(p);
+    buffer.length = buffer.capacity = st.st_size;
+    buffer.mapped = true;
+  }
+  close(fd);
+#else
+  std::ifstream file(name, std::ifstream::binary);
+  if (!file) {
+    perror(name.c_str());
+    return false;
+  }
+
+  file.seekg(0, std::ios::end);
+  size_t size = file.tellg();
+  file.seekg(0, std::ios::beg);
+
+  buffer.resize(size);
+  file.read(reinterpret_cast<char*>(buffer.data()), size);
+#endif
+  return true;
+}
+
+Buffer Buffer::allocate(size_t size, bool huge_pages) {
+  Buffer buffer;
+  if (!size) return buffer;
+#ifndef _WIN32
+  void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  // explicit huge pages only exist if the administrator reserved them
+  if (huge_pages) {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  buffer.ptr = static_cast<uint8_t*>(p);
+  buffer.length = buffer.capacity = size;
+  buffer.mapped = true;
+#else
+  buffer.resize(size);
+#endif
+  return buffer;
+}
+
+void Buffer::resize(size_t size) {
+  if (size <= capacity) {
+    if (size > length) memset(ptr + length, 0, size - length);
+    length = size;
+    return;
+  }
+
+  uint8_t* p = static_cast<uint8_t*>(calloc(size, 1));
+  if (!p) {
+    perror("calloc");
+    exit(1);
+  }
+  if (length) memcpy(p, ptr, length);
+  release();
+  ptr = p;
+  length = capacity = size;
+}
+
+void Buffer::drop_pages() {
+#ifndef _WIN32
+  if (mapped && ptr) madvise(ptr, capacity, MADV_DONTNEED);
+#endif
+}
+
+bool write_file(const std::string& file_name, const uint8_t* data,
+                size_t size) {
+#ifndef _WIN32
+  int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    perror(file_name.c_str());
+    return false;
+  }
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t n = pwrite(fd, data + offset, size - offset, offset);
+    if (n <= 0) {
+      perror(file_name.c_str());
+      close(fd);
+      return false;
+    }
+    offset += n;
+  }
+  return close(fd) == 0;
+#else
+  std::ofstream os(file_name, std::ofstream::out | std::ofstream::binary |
+                                  std::ofstream::trunc);
+  os.write(reinterpret_cast<const char*>(data), size);
+  return bool(os);
+#endif
+}
+
+OutputFile::OutputFile(const std::string& file_name) : name(file_name) {
+  if (name == "-") {
+    // keep the real stdout for the image and send printf to stderr
+    fflush(stdout);
+    int fd = dup(fileno(stdout));
+    dup2(fileno(stderr), fileno(stdout));
+    file = fdopen(fd, "wb");
+  } else {
+    file = fopen(name.c_str(), "wb");
+  }
+  if (!file) {
+    perror(name.c_str());
+    exit(1);
+  }
+  can_seek = fseek(file, 0, SEEK_CUR) == 0;
+}
+
+OutputFile::OutputFile(FILE* file, const std::string& name)
+    : name(name), file(file) {
+  can_seek = fseek(file, 0, SEEK_CUR) == 0;
+}
+
+OutputFile::~OutputFile() { close(); }
+
+void OutputFile::fail() {
+  if (!failed) perror(name.c_str());
+  failed = true;
+}
+
+void OutputFile::write(const uint8_t* data, size_t size) {
+  if (failed || !file) return;
+  if (fwrite(data, 1, size, file) != size) fail();
+}
+
+void OutputFile::write_at(size_t offset, const uint8_t* data, size_t size) {
+  if (failed || !file) return;
+  long position = ftell(file);
+  if (fseek(file, offset, SEEK_SET) != 0) {
+    fail();
+    return;
+  }
+  write(data, size);
+  fseek(file, position, SEEK_SET);
+}
+
+void OutputFile::close() {
+  if (file && fclose(file) != 0) fail();
+  file = nullptr;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Byte buffer for whole ROM images. Where the platform allows it, files are
+// mapped instead of read and large buffers come straight from the kernel, so
+// untouched pages cost no memory and nothing is copied twice.
+class Buffer {
+ public:
+  Buffer() = default;
+  Buffer(Buffer&& other) noexcept;
+  Buffer& operator=(Buffer&& other) noexcept;
+  Buffer(const Buffer&) = delete;
+  Buffer& operator=(const Buffer&) = delete;
+  ~Buffer();
+
+  // private, writable view of a file; writes never reach the file itself
+  static Buffer map_file(const std::string& name);
+  // same, but returns false after printing the error instead of exiting
+  static bool map_file(const std::string& name, Buffer& buffer);
+  // zero-filled buffer, optionally backed by huge pages
+  static Buffer allocate(size_t size, bool huge_pages = false);
+
+  uint8_t* data() { return ptr; }
+  const uint8_t* data() const { return ptr; }
+  size_t size() const { return length; }
+  uint8_t* begin() { return ptr; }
+  uint8_t* end() { return ptr + length; }
+  const uint8_t* begin() const { return ptr; }
+  const uint8_t* end() const { return ptr + length; }
+  uint8_t& operator[](size_t i) { return ptr[i]; }
+  const uint8_t& operator[](size_t i) const { return ptr[i]; }
+
+  // new bytes are zero; growing past the original size reallocates
+  void resize(size_t size);
+  // Gives the pages back to the system. A mapped file reads back as it is on
+  // disk, anything else as zeros; only for buffers that are not read again.
+  void drop_pages();
+
+ private:
+  void release();
+
+  uint8_t* ptr = nullptr;
+  size_t length = 0;
+  size_t capacity = 0;
+  bool mapped = false;
+};
+
+// Writes size bytes to file_name with as few system calls as possible.
+bool write_file(const std::string& file_name, const uint8_t* data,
+                size_t size);
+
+// Destination for an image that is produced front to back. "-" writes to
+// stdout; progress messages then move to stderr.
+class OutputFile {
+ public:
+  explicit OutputFile(const std::string& file_name);
+  // takes over file, which is already open for writing; name is for errors
+  OutputFile(FILE* file, const std::string& name);
+  ~OutputFile();
+
+  // false for pipes and sockets, which can only be appended to
+  bool seekable() const { return can_seek; }
+  // An error is printed once and makes every later call do nothing; ok()
+  // tells whether everything so far was written.
+  void write(const uint8_t* data, size_t size);
+  // overwrites bytes written earlier, only if seekable()
+  void write_at(size_t offset, const uint8_t* data, size_t size);
+  void close();
+  bool ok() const { return !failed; }
+
+ private:
+  std::string name;
+  FILE* file = nullptr;
+  bool can_seek = false;
+  bool failed = false;
+
+  void fail();
+};
@@ -0,0 +1,121 @@
+#include "byteorder.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define BYTEORDER_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define BYTEORDER_TARGET(x)
+#else
+#define BYTEORDER_TARGET(x) __attribute__((target(x)))
+#endif
+
+ByteOrder detect_byte_order(const uint8_t* data, size_t size) {
+  if (size >= 4) {
+    if (data[0] == 0x37 && data[1] == 0x80) return ByteOrder::swapped;
+    if (data[0] == 0x40 && data[1] == 0x12) return ByteOrder::little;
+  }
+  return ByteOrder::big;
+}
+
+const char* byte_order_name(ByteOrder order) {
+  switch (order) {
+    case ByteOrder::big:
+      return "z64";
+    case ByteOrder::swapped:
+      return "v64";
+    case ByteOrder::little:
+      return "n64";
+  }
+  return "unknown";
+}
+
+namespace {
+
+// converts data[i, size) with scalar word swaps
+void convert_scalar(uint8_t* data, size_t i, size_t size, ByteOrder order) {
+  if (order == ByteOrder::swapped) {
+    for (; i + 2 <= size; i += 2) {
+      uint16_t v;
+      memcpy(&v, data + i, 2);
+      v = byteSwap(v);
+      memcpy(data + i, &v, 2);
+    }
+  } else {
+    for (; i + 4 <= size; i += 4) {
+      uint32_t v;
+      memcpy(&v, data + i, 4);
+      v = byteSwap(v);
+      memcpy(data + i, &v, 4);
+    }
+  }
+}
+
+#ifdef BYTEORDER_X86
+
+// SSE2 is part of x86-64, so this needs no check
+size_t convert_sse2(uint8_t* data, size_t size, ByteOrder order) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i* p = reinterpret_cast<__m128i*>(data + i);
+    __m128i v = _mm_loadu_si128(p);
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    if (order == ByteOrder::little) {
+      // swap the 16-bit halves of every word as well
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+    }
+    _mm_storeu_si128(p, v);
+  }
+  return i;
+}
+
+BYTEORDER_TARGET("avx2")
+size_t convert_avx2(uint8_t* data, size_t size, ByteOrder order) {
+  const __m256i swap16 = _mm256_setr_epi8(
+      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,  //
+      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  const __m256i swap32 = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,  //
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  const __m256i mask = order == ByteOrder::swapped ? swap16 : swap32;
+
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m256i* p = reinterpret_cast<__m256i*>(data + i);
+    __m256i a = _mm256_loadu_si256(p);
+    __m256i b = _mm256_loadu_si256(p + 1);
+    _mm256_storeu_si256(p, _mm256_shuffle_epi8(a, mask));
+    _mm256_storeu_si256(p + 1, _mm256_shuffle_epi8(b, mask));
+  }
+  return i;
+}
+
+bool has_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return false;
+#else
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#endif
+}
+
+#endif
+
+}  // namespace
+
+void convert_byte_order(uint8_t* data, size_t size, ByteOrder order) {
+  if (order == ByteOrder::big) return;
+
+  size_t done = 0;
+#ifdef BYTEORDER_X86
+  if (has_avx2()) done = convert_avx2(data, size, order);
+  done += convert_sse2(data + done, size - done, order);
+#endif
+  convert_scalar(data, done, size, order);
+}
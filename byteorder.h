@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The three ways N64 ROM images are stored on disk. The tools work on
+// big-endian images and convert everything else when loading.
+enum class ByteOrder {
+  big,       // .z64, native
+  swapped,   // .v64, bytes of every 16-bit word swapped
+  little     // .n64, bytes of every 32-bit word reversed
+};
+
+// Tells the order from the first word of the header; anything unknown is
+// taken as big-endian.
+ByteOrder detect_byte_order(const uint8_t* data, size_t size);
+const char* byte_order_name(ByteOrder order);
+
+// Converts between big-endian and order in place. Each conversion is its own
+// inverse, so the same call also converts back. A trailing partial word is
+// left as is.
+void convert_byte_order(uint8_t* data, size_t size, ByteOrder order);
@@ -0,0 +1,200 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "sha256.h"
+
+namespace fs = std::filesystem;
+
+// every cache file starts with this, followed by the payload size and the
+// SHA-256 of the payload
+static const char cache_magic[8] = {'O', 'o', 'T', 'C', 'a', 'c', 'h', '2'};
+#define CACHE_HEADER_SIZE (8 + 8 + 32)
+
+CompressionCache::CompressionCache(const std::string& dir, uint64_t max_bytes)
+    : dir(dir), max_bytes(max_bytes), temp_count(0) {
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  if (ec) {
+    fprintf(stderr, "Cache directory %s: %s\n", dir.c_str(),
+            ec.message().c_str());
+    exit(1);
+  }
+}
+
+std::string CompressionCache::key(const uint8_t* data, size_t size,
+                                  int format, int version, int level,
+                                  uint64_t settings) {
+  SHA256 sha;
+  sha.update(data, size);
+  uint8_t suffix[32];
+  uint64_t fields[4] = {uint64_t(format), uint64_t(version), uint64_t(level),
+                        settings};
+  for (int i = 0; i < 32; i++) suffix[i] = fields[i / 8] >> (8 * (i % 8));
+  sha.update(suffix, sizeof(suffix));
+  return SHA256::hex(sha.finish());
+}
+
+std::string CompressionCache::path(const std::string& key) const {
+  return (fs::path(dir) / key).string();
+}
+
+bool CompressionCache::load(const std::string& key, std::vector<uint8_t>& out) {
+  std::ifstream is(path(key), std::ifstream::binary | std::ifstream::ate);
+  uint64_t file_size = is ? uint64_t(is.tellg()) : 0;
+  char magic[8];
+  uint64_t size = 0;
+  SHA256::Digest digest;
+  // a truncated or corrupt entry must not make us allocate whatever its
+  // size field says, nor land in the ROM
+  if (is && file_size >= CACHE_HEADER_SIZE && is.seekg(0) &&
+      is.read(magic, 8) && !memcmp(magic, cache_magic, 8) &&
+      is.read(reinterpret_cast<char*>(&size), sizeof(size)) &&
+      size == file_size - CACHE_HEADER_SIZE &&
+      is.read(reinterpret_cast<char*>(digest.data()), digest.size())) {
+    out.resize(size);
+    if (is.read(reinterpret_cast<char*>(out.data()), size) &&
+        SHA256::hash(out.data(), out.size()) == digest) {
+      // refresh the entry for LRU eviction
+      std::error_code ec;
+      fs::last_write_time(path(key), fs::file_time_type::clock::now(), ec);
+      hit_count++;
+      return true;
+    }
+  }
+  out.clear();
+  miss_count++;
+  return false;
+}
+
+void CompressionCache::store(const std::string& key, const uint8_t* data,
+                             size_t size) {
+  // other processes only ever see complete files: write under a unique name,
+  // then rename over the final one
+  std::string temp = path(key) + ".tmp." + std::to_string(getpid()) + "." +
+                     std::to_string(temp_count++);
+  {
+    std::ofstream os(temp, std::ofstream::binary | std::ofstream::trunc);
+    uint64_t payload_size = size;
+    SHA256::Digest digest = SHA256::hash(data, size);
+    os.write(cache_magic, 8);
+    os.write(reinterpret_cast<const char*>(&payload_size),
+             sizeof(payload_size));
+    os.write(reinterpret_cast<const char*>(digest.data()), digest.size());
+    os.write(reinterpret_cast<const char*>(data), size);
+    if (!os) {
+      std::error_code ec;
+      fs::remove(temp, ec);
+      return;
+    }
+  }
+  std::error_code ec;
+  fs::rename(temp, path(key), ec);
+  if (ec) fs::remove(temp, ec);
+}
+
+void CompressionCache::evict() {
+  struct File {
+    fs::file_time_type time;
+    uint64_t size;
+    fs::path path;
+  };
+  std::vector<File> files;
+  uint64_t total = 0;
+  auto now = fs::file_time_type::clock::now();
+
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator(dir, ec)) {
+    std::error_code file_ec;
+    if (!entry.is_regular_file(file_ec)) continue;
+    auto time = entry.last_write_time(file_ec);
+    uint64_t size = entry.file_size(file_ec);
+    if (file_ec) continue;
+
+    // leftovers of processes that died while writing
+    if (entry.path().string().find(".tmp.") != std::string::npos) {
+      if (now - time > std::chrono::hours(1)) fs::remove(entry.path(), file_ec);
+      continue;
+    }
+    files.push_back({time, size, entry.path()});
+    total += size;
+  }
+
+  std::sort(files.begin(), files.end(),
+            [](const File& a, const File& b) { return a.time < b.time; });
+  for (const File& file : files) {
+    if (total <= max_bytes) break;
+    // entries removed by another process at the same time are fine too
+    fs::remove(file.path, ec);
+    total -= file.size;
+  }
+}
+
+MemoryCache::MemoryCache(uint64_t max_bytes, EntryCache* next)
+    : max_bytes(max_bytes), next(next) {}
+
+bool MemoryCache::load(const std::string& key, std::vector<uint8_t>& out) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      out = it->second->second;
+      hit_count++;
+      return true;
+    }
+  }
+  miss_count++;
+  if (!next || !next->load(key, out)) return false;
+  insert(key, out.data(), out.size());
+  return true;
+}
+
+void MemoryCache::store(const std::string& key, const uint8_t* data,
+                        size_t size) {
+  insert(key, data, size);
+  if (next) next->store(key, data, size);
+}
+
+void MemoryCache::insert(const std::string& key, const uint8_t* data,
+                         size_t size) {
+  if (size > max_bytes) return;
+  std::vector<uint8_t> copy(data, data + size);
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = index.find(key);
+  if (it != index.end()) {
+    total -= it->second->second.size();
+    lru.erase(it->second);
+    index.erase(it);
+  }
+  lru.emplace_front(key, std::move(copy));
+  index[key] = lru.begin();
+  total += size;
+  while (total > max_bytes) {
+    total -= lru.back().second.size();
+    index.erase(lru.back().first);
+    lru.pop_back();
+  }
+}
+
+size_t MemoryCache::entries() const {
+  std::unique_lock<std::mutex> lock(mutex);
+  return lru.size();
+}
+
+uint64_t MemoryCache::bytes() const {
+  std::unique_lock<std::mutex> lock(mutex);
+  return total;
+}
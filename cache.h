@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Compressed files by key, as made by CompressionCache::key; safe to use
+// from any thread
+class EntryCache {
+ public:
+  virtual ~EntryCache() {}
+
+  virtual bool load(const std::string& key, std::vector<uint8_t>& out) = 0;
+  virtual void store(const std::string& key, const uint8_t* data,
+                     size_t size) = 0;
+
+  size_t hits() const { return hit_count; }
+  size_t misses() const { return miss_count; }
+
+ protected:
+  std::atomic<size_t> hit_count{0};
+  std::atomic<size_t> miss_count{0};
+};
+
+// On-disk cache of compressed files, shared between runs and processes.
+// Entries are named after a hash of the uncompressed bytes and the encoder
+// settings, written to a temporary file and renamed into place, and evicted
+// least recently used first once the directory grows past its size limit.
+// Entries carry a SHA-256 of their payload; one that is truncated or does not
+// match it is a miss.
+class CompressionCache : public EntryCache {
+ public:
+  CompressionCache(const std::string& dir, uint64_t max_bytes);
+
+  // settings is anything else that changes the encoder output
+  static std::string key(const uint8_t* data, size_t size, int format,
+                         int version, int level, uint64_t settings = 0);
+
+  bool load(const std::string& key, std::vector<uint8_t>& out) override;
+  void store(const std::string& key, const uint8_t* data,
+             size_t size) override;
+  // drop the least recently used entries until the cache fits its limit
+  void evict();
+
+ private:
+  std::string path(const std::string& key) const;
+
+  std::string dir;
+  uint64_t max_bytes;
+  std::atomic<size_t> temp_count;
+};
+
+// Cache of a long-running process, kept in memory and dropping the least
+// recently used entries past max_bytes. Misses are looked up in next, if
+// given, and everything stored goes there too.
+class MemoryCache : public EntryCache {
+ public:
+  explicit MemoryCache(uint64_t max_bytes, EntryCache* next = nullptr);
+
+  bool load(const std::string& key, std::vector<uint8_t>& out) override;
+  void store(const std::string& key, const uint8_t* data,
+             size_t size) override;
+
+  size_t entries() const;
+  uint64_t bytes() const;
+
+ private:
+  typedef std::list<std::pair<std::string, std::vector<uint8_t>>> List;
+
+  void insert(const std::string& key, const uint8_t* data, size_t size);
+
+  uint64_t max_bytes;
+  EntryCache* next;
+  mutable std::mutex mutex;
+  // most recently used first
+  List lru;
+  std::unordered_map<std::string, List::iterator> index;
+  uint64_t total = 0;
+};
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+#include "protocol.h"
+
+#define DCMPSIZE 0x4000000
+
+namespace fs = std::filesystem;
+
+void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s --socket PATH [options] compress|decompress file "
+          "[outfile]\n"
+          "       %s --socket PATH stats|shutdown\n"
+          "  --socket PATH    socket of a compressor started with --serve\n"
+          "  --priority N     jobs with a higher priority run first, from "
+          "-100 to 100 (default 0)\n"
+          "  --client NAME    jobs of different clients take turns "
+          "(default: the user id)\n"
+          "  --level N        compression level\n"
+          "  --format NAME    Yaz0, Yay0 or MIO0\n"
+          "  --send           send the ROM and receive the result over the "
+          "socket instead of passing file names\n",
+          argv0, argv0);
+}
+
+int main(int argc, char** argv) {
+  std::string socket_path;
+  Message request;
+  bool send = false;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--socket" && has_value) {
+      socket_path = argv[++i];
+    } else if (arg == "--priority" && has_value) {
+      request.set("priority", argv[++i]);
+    } else if (arg == "--client" && has_value) {
+      request.set("client", argv[++i]);
+    } else if (arg == "--level" && has_value) {
+      request.set("level", argv[++i]);
+    } else if (arg == "--format" && has_value) {
+      request.set("format", argv[++i]);
+    } else if (arg == "--send") {
+      send = true;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (socket_path.empty() || args.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  request.command = args[0];
+  bool job = request.command == "compress" || request.command == "decompress";
+  if (job ? args.size() != 2 && args.size() != 3 : args.size() != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (request.get("client").empty()) {
+    request.set("client", "uid " + std::to_string(getuid()));
+  }
+
+  std::string outname;
+  std::vector<uint8_t> input;
+  if (job) {
+    std::string name = args[1];
+    outname = args.size() == 3
+                  ? args[2]
+                  : name.substr(0, name.find_last_of('.')) +
+                        (request.command == "compress" ? "-comp.z64"
+                                                       : "-decomp.z64");
+    if (send) {
+      std::ifstream file(name, std::ifstream::binary);
+      if (!file) {
+        perror(name.c_str());
+        return 1;
+      }
+      input.assign(std::istreambuf_iterator<char>(file),
+                   std::istreambuf_iterator<char>());
+    } else {
+      // the daemon runs somewhere else
+      std::error_code ec;
+      request.set("input", fs::absolute(name, ec).string());
+      request.set("output", fs::absolute(outname, ec).string());
+    }
+  }
+
+  int fd = connect_unix(socket_path);
+  if (fd < 0) return 1;
+  Message reply;
+  std::vector<uint8_t> output;
+  if (!write_message(fd, request, input.data(), input.size()) ||
+      !read_message(fd, reply, output, DCMPSIZE)) {
+    fprintf(stderr, "Error: the daemon closed the connection\n");
+    return 1;
+  }
+  close(fd);
+  if (reply.command != "ok") {
+    std::string reason = reply.command;
+    if (reason.compare(0, 6, "error ") == 0) reason = reason.substr(6);
+    fprintf(stderr, "Error: %s\n", reason.c_str());
+    return 1;
+  }
+
+  if (!job) {
+    fwrite(output.data(), 1, output.size(), stdout);
+    return 0;
+  }
+  if (send && !write_file(outname, output.data(), output.size())) return 1;
+  printf("%s %s in %.1f ms after %.1f ms in the queue\n",
+         request.command == "compress" ? "Compressed" : "Decompressed",
+         outname.c_str(), atof(reply.get("run-ms").c_str()),
+         atof(reply.get("queue-ms").c_str()));
+  return 0;
+}
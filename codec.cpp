@@ -0,0 +1,152 @@
+#include "codec.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "readwrite.h"
+#include "yay0.h"
+#include "yaz0.h"
+
+static const char* const format_names[] = {"Yaz0", "Yay0", "MIO0"};
+
+const char* format_name(Format format) { return format_names[int(format)]; }
+
+bool parse_format(const std::string& name, Format* format) {
+  for (int i = 0; i < 3; i++) {
+    const char* candidate = format_names[i];
+    if (name.size() != strlen(candidate)) continue;
+    size_t j = 0;
+    while (j < name.size() && tolower((unsigned char)name[j]) ==
+                                  tolower((unsigned char)candidate[j])) {
+      j++;
+    }
+    if (j == name.size()) {
+      *format = Format(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool detect_format(const uint8_t* src, size_t src_size, Format* format) {
+  if (src_size < 4) return false;
+  for (int i = 0; i < 3; i++) {
+    if (!memcmp(src, format_names[i], 4)) {
+      *format = Format(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// every format keeps the decompressed size right after the magic
+bool Codec::decoded_size(const uint8_t* src, size_t src_size,
+                         size_t* size) const {
+  if (src_size < 0x10 || memcmp(src, format_name(format()), 4)) return false;
+  *size = U32(src + 4);
+  return true;
+}
+
+// a 0-byte result would go into the ROM as if it were the file
+[[noreturn]] static void cannot_split(Format format) {
+  fprintf(stderr, "Error: %s files cannot be split into segments\n",
+          format_name(format));
+  abort();
+}
+
+size_t Codec::segment_bound(size_t) const { cannot_split(format()); }
+
+size_t Codec::encode_segment(const uint8_t*, size_t, size_t, uint8_t*) {
+  cannot_split(format());
+}
+
+size_t Codec::join_segments(const uint8_t* const*, const size_t*, size_t,
+                            uint8_t*) const {
+  cannot_split(format());
+}
+
+namespace {
+
+class Yaz0Codec : public Codec {
+ public:
+  explicit Yaz0Codec(int level)
+      : encoder(Yaz0MatchFinder::hash_chain, level) {}
+
+  Format format() const override { return Format::yaz0; }
+  int version() const override { return YAZ0_ENCODER_VERSION; }
+  size_t bound(size_t src_size) const override { return yaz0_bound(src_size); }
+  size_t encode(const uint8_t* src, size_t src_size, uint8_t* dest) override {
+    return encoder.encode(src, src_size, dest);
+  }
+  void set_cancel(const std::atomic<bool>* flag) override {
+    encoder.set_cancel(flag);
+  }
+  bool decode(const uint8_t* src, size_t src_size, uint8_t* dest,
+              size_t dest_size) const override {
+    return src_size >= 0x10 && !memcmp(src, "Yaz0", 4) &&
+           yaz0_decode_checked(src, src_size, dest, dest_size);
+  }
+
+  bool can_split() const override { return true; }
+  size_t segment_bound(size_t segment_size) const override {
+    return yaz0_segment_bound(segment_size);
+  }
+  size_t encode_segment(const uint8_t* src, size_t start, size_t end,
+                        uint8_t* dest) override {
+    return encoder.encode_segment(src, start, end, dest);
+  }
+  size_t join_segments(const uint8_t* const* segments,
+                       const size_t* segment_sizes, size_t count,
+                       uint8_t* dest) const override {
+    return yaz0_join_segments(segments, segment_sizes, count, dest);
+  }
+
+ private:
+  Yaz0Encoder encoder;
+};
+
+class SplitStreamCodec : public Codec {
+ public:
+  SplitStreamCodec(SplitStreamFormat stream, int level)
+      : stream(stream), encoder(stream, level) {}
+
+  Format format() const override {
+    return stream == SplitStreamFormat::mio0 ? Format::mio0 : Format::yay0;
+  }
+  int version() const override {
+    return stream == SplitStreamFormat::mio0 ? MIO0_ENCODER_VERSION
+                                             : YAY0_ENCODER_VERSION;
+  }
+  size_t bound(size_t src_size) const override { return yay0_bound(src_size); }
+  size_t encode(const uint8_t* src, size_t src_size, uint8_t* dest) override {
+    return encoder.encode(src, src_size, dest);
+  }
+  void set_cancel(const std::atomic<bool>* flag) override {
+    encoder.set_cancel(flag);
+  }
+  bool decode(const uint8_t* src, size_t src_size, uint8_t* dest,
+              size_t dest_size) const override {
+    return yay0_decode(src, src_size, dest, dest_size, stream);
+  }
+
+ private:
+  SplitStreamFormat stream;
+  Yay0Encoder encoder;
+};
+
+}  // namespace
+
+std::unique_ptr<Codec> Codec::create(Format format, int level) {
+  switch (format) {
+    case Format::yay0:
+      return std::unique_ptr<Codec>(
+          new SplitStreamCodec(SplitStreamFormat::yay0, level));
+    case Format::mio0:
+      return std::unique_ptr<Codec>(
+          new SplitStreamCodec(SplitStreamFormat::mio0, level));
+    default:
+      return std::unique_ptr<Codec>(new Yaz0Codec(level));
+  }
+}
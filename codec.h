@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// highest level Codec::create takes
+#define CODEC_MAX_LEVEL 2
+
+enum class Format { yaz0, yay0, mio0 };
+
+// "Yaz0", "Yay0" or "MIO0", the magic every stream of the format starts with
+const char* format_name(Format format);
+// takes the name in any case
+bool parse_format(const std::string& name, Format* format);
+// false if src starts with none of the magics
+bool detect_format(const uint8_t* src, size_t src_size, Format* format);
+
+// Encoder and decoder of one format, so the compressor, the decompressor and
+// the benchmarks work the same for all of them. Encoders keep their match
+// tables between calls; use one Codec per thread for encoding. Decoding does
+// not change the codec and may run on several threads at once.
+class Codec {
+ public:
+  // level 0 is greedy, 1 lazy and 2 an optimal parse; see Yaz0Encoder
+  static std::unique_ptr<Codec> create(Format format, int level = 0);
+  virtual ~Codec() {}
+
+  virtual Format format() const = 0;
+  // changes whenever the encoder output does, for cache keys
+  virtual int version() const = 0;
+  // worst-case size of an encoded stream, header and padding included
+  virtual size_t bound(size_t src_size) const = 0;
+  // Encodes src into dest, which must hold bound(src_size) bytes, and returns
+  // the padded size, or 0 if src_size is too large.
+  virtual size_t encode(const uint8_t* src, size_t src_size,
+                        uint8_t* dest) = 0;
+  // Makes encode stop early and return 0 once *flag turns true, until set
+  // back to null.
+  virtual void set_cancel(const std::atomic<bool>* flag) = 0;
+  // Decodes exactly dest_size bytes; false if src is corrupt, of another
+  // format or too short.
+  virtual bool decode(const uint8_t* src, size_t src_size, uint8_t* dest,
+                      size_t dest_size) const = 0;
+  // size from the header; false if src is not of this format
+  bool decoded_size(const uint8_t* src, size_t src_size, size_t* size) const;
+
+  // Only Yaz0 can encode a file as segments in parallel and join them; see
+  // Yaz0Encoder::encode_segment. The others abort unless can_split() is true.
+  virtual bool can_split() const { return false; }
+  virtual size_t segment_bound(size_t segment_size) const;
+  virtual size_t encode_segment(const uint8_t* src, size_t start, size_t end,
+                                uint8_t* dest);
+  virtual size_t join_segments(const uint8_t* const* segments,
+                               const size_t* segment_sizes, size_t count,
+                               uint8_t* dest) const;
+};
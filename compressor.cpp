@@ -1,82 +1,883 @@
+#include "compressor.h"
+
+#include <algorithm>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "ThreadPool.h"
+#include "cache.h"
+#include "codec.h"
+#include "cpu.h"
+#include "dedup.h"
 #include "rom.h"
+#include "slab.h"
+#include "stats.h"
 #include "yaz0.h"
 
+#ifndef _WIN32
+#include "server.h"
+#endif
+
 #define UINTSIZE 0x1000000
 #define COMPSIZE 0x2000000
 #define DCMPSIZE 0x4000000
 
-void compression_thread(const uint8_t* data, size_t size, size_t index,
-                        std::vector<uint8_t>& out,
-                        std::atomic<int>& thread_count) {
-  out = yaz0_encode(data, size);
-  thread_count--;
+// fix_crc reads everything up to here
+#define CHECKSUM_END 0x101000
+
+// Scratch memory of one encoder beyond its input and output: the hash chains,
+// and at level 2 the tables of the optimal parse per byte of a block
+#define ENCODER_MEMORY 0x40000
+#define OPTIMAL_PARSE_BLOCK 0x40000
+#define OPTIMAL_PARSE_MEMORY 12
+
+struct SplitFile {
+  size_t index;
+  // code streams in the slab
+  std::vector<const uint8_t*> segments;
+  std::vector<size_t> segment_sizes;
+  std::vector<double> segment_cpu;
+  std::atomic<size_t> remaining{0};
+  std::atomic<double> queued{0};
+  std::atomic<double> start{1e300};
+};
+
+// times any worker arena had to grow
+static std::atomic<uint64_t> arena_growth(0);
+
+// Memory of one worker, kept for as long as the thread runs. The encoders
+// keep their match tables and the buffers only grow, so once a worker has
+// seen its largest file, encoding allocates nothing.
+struct WorkerArena {
+  // one per format and level, created on first use
+  std::unique_ptr<Codec> codecs[3 * (CODEC_MAX_LEVEL + 1)];
+  // encoder output, copied to the slab once its size is known
+  std::vector<uint8_t> output;
+  // decoded files for comparison
+  std::vector<uint8_t> decoded;
+
+  static WorkerArena& get() {
+    thread_local WorkerArena arena;
+    return arena;
+  }
+
+  // gives everything back, for runs with bounded memory
+  void trim() {
+    for (auto& codec : codecs) codec.reset();
+    std::vector<uint8_t>().swap(output);
+    std::vector<uint8_t>().swap(decoded);
+  }
+
+  Codec& codec(Format format, int level) {
+    std::unique_ptr<Codec>& codec =
+        codecs[int(format) * (CODEC_MAX_LEVEL + 1) + level];
+    if (!codec) codec = Codec::create(format, level);
+    return *codec;
+  }
+
+  // at least size bytes of buffer
+  static uint8_t* reserve(std::vector<uint8_t>& buffer, size_t size) {
+    if (buffer.capacity() < size) arena_growth++;
+    if (buffer.size() < size) buffer.resize(size);
+    return buffer.data();
+  }
+};
+
+// Encoding time and output size of each level relative to level 0, measured
+// on a sample ROM
+static const double level_cpu[CODEC_MAX_LEVEL + 1] = {1, 3.5, 12};
+static const double level_size[CODEC_MAX_LEVEL + 1] = {1, 0.979, 0.968};
+
+// Moving one file to a stronger level: the CPU milliseconds it is expected
+// to take and the bytes it is expected to save
+struct Upgrade {
+  size_t index;
+  int level;
+  double cpu;
+  double saved;
+};
+
+// Takes upgrades with the most bytes saved per CPU second first, for as long
+// as threads can still finish them all within time_left milliseconds. A
+// stronger level of a file replaces its weaker one. Returns the CPU time of
+// the plan.
+static double plan_upgrades(std::vector<Upgrade>& upgrades, double time_left,
+                            int threads, std::vector<int>& levels,
+                            std::vector<double>& cpu) {
+  std::stable_sort(upgrades.begin(), upgrades.end(),
+                   [](const Upgrade& a, const Upgrade& b) {
+                     return a.saved * b.cpu > b.saved * a.cpu;
+                   });
+  double capacity = threads * time_left;
+  double planned = 0;
+  for (const Upgrade& u : upgrades) {
+    // a single job longer than the time left cannot make it on any thread
+    if (u.level <= levels[u.index] || u.cpu > time_left) continue;
+    double extra = u.cpu - cpu[u.index];
+    if (extra > capacity - planned) continue;
+    planned += extra;
+    levels[u.index] = u.level;
+    cpu[u.index] = u.cpu;
+  }
+  return planned;
 }
 
-int cpu_count() {
-  int n = std::thread::hardware_concurrency();
-  switch (n) {
-    case 0:
-      return 2;
-    case 1:
-      return 3;
-    default:
-      return n + 2;
+// Bytes a file holds from the start of its job until it is written when
+// memory is bounded: its input, its result, the encoder and the copy that
+// --verify decodes
+static size_t file_memory(const Options& options, size_t size, size_t bound) {
+  size_t memory = size + bound + ENCODER_MEMORY;
+  if (options.level == 2) {
+    memory +=
+        std::min<size_t>(size, OPTIMAL_PARSE_BLOCK) * OPTIMAL_PARSE_MEMORY;
   }
+  // Yay0 and MIO0 collect their streams apart before joining them
+  if (options.format != Format::yaz0) memory += bound;
+  if (options.verify) memory += size;
+  return memory;
 }
 
-void compress(const std::string& name, const std::string& outname) {
-  N64ROM rom(name);
+// true if data is in the format of codec and decodes to exactly the size
+// bytes at original
+static bool decodes_to(const Codec& codec, const uint8_t* data,
+                       size_t data_size, const uint8_t* original,
+                       size_t size) {
+  uint8_t* decoded = WorkerArena::reserve(WorkerArena::get().decoded, size);
+  return codec.decode(data, data_size, decoded, size) &&
+         !memcmp(decoded, original, size);
+}
+
+// Files finish in any order but are written in table order
+class Completion {
+ public:
+  explicit Completion(size_t count) : ready(count) {}
+
+  // notifies under the lock, so the waiter cannot destroy this object before
+  // a mark from another thread has returned
+  void mark(size_t i) {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready[i] = 1;
+    condition.notify_all();
+  }
+
+  // returns false if file i is still not done after timeout
+  template <class Rep, class Period>
+  bool wait_for(size_t i, const std::chrono::duration<Rep, Period>& timeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return condition.wait_for(lock, timeout, [&] { return ready[i] != 0; });
+  }
+
+  void wait_all() {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] {
+      return std::find(ready.begin(), ready.end(), 0) == ready.end();
+    });
+  }
+
+ private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::vector<uint8_t> ready;
+};
+
+// prints one line at once, so the lines of concurrent ROMs do not mix
+static void log_line(const std::string& prefix, const char* format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  printf("%s%s\n", prefix.c_str(), line);
+}
+
+// prints why a ROM failed and keeps the reason for the caller
+static void report_error(const std::string& prefix, std::string* error,
+                         const char* format, ...) {
+  char reason[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(reason, sizeof(reason), format, args);
+  va_end(args);
+  fprintf(stderr, "%sError: %s\n", prefix.c_str(), reason);
+  if (error) *error = reason;
+}
+
+bool compress(const std::string& name, const std::string& outname,
+              const Options& options, const Context& context,
+              std::unique_ptr<OutputFile> stream, Buffer image,
+              std::string* error) {
+  RunStats stats;
+  uint64_t heap_start = heap_allocations();
+  uint64_t arena_start = arena_growth;
+  std::string prefix = context.batch ? name + ": " : "";
+  if (stream && !stream->seekable()) {
+    log_line(prefix, "Output is not seekable, writing it once compression is "
+                     "done");
+  }
+
+  double load_start = stats.now();
+  N64ROM rom = image.size() ? N64ROM(std::move(image), options.huge_pages)
+                            : N64ROM(name, options.huge_pages);
+  stats.phase("load", load_start, load_start + rom.load_time());
+  stats.phase("read_table", load_start + rom.load_time(),
+              load_start + rom.load_time() + rom.table_time());
+  stats.set_entry_count(rom.entry_count());
 
   // Load the compression index
+  if (rom.entry_count() < 4) {
+    report_error(prefix, error, "the file table has %zu entries",
+                 rom.entry_count());
+    return false;
+  }
   const N64ROM::table_entry& compression_index_entry =
       rom.inEntry(rom.entry_count() - 1);
   if (!compression_index_entry.startP) {
-    fprintf(stderr,
-            "Compression index missing, please use the decompressor from this "
-            "repository on the ROM\n");
-    exit(1);
+    report_error(prefix, error,
+                 "compression index missing, please use the decompressor "
+                 "from this repository on the ROM");
+    return false;
+  }
+  // the table may come from anyone when running as a daemon
+  if (compression_index_entry.startP + rom.entry_count() > rom.in().size()) {
+    report_error(prefix, error, "the compression index is out of bounds");
+    return false;
+  }
+  for (size_t i = 3; i < rom.entry_count(); i++) {
+    const auto& entry = rom.inEntry(i);
+    if (entry.endV < entry.startV ||
+        size_t(entry.startP) + entry.size() > rom.in().size()) {
+      report_error(prefix, error, "table entry %zu is out of bounds", i);
+      return false;
+    }
   }
   std::vector<uint8_t> compression_index(
       rom.in().data() + compression_index_entry.startP,
       rom.in().data() + compression_index_entry.startP + rom.entry_count());
 
-  std::atomic<int> numThreads = 0;
-  std::vector<std::vector<uint8_t>> compressed_data;
-  compressed_data.resize(rom.entry_count());
+  // Bounded memory reads every file from the input again when it is encoded
+  // and writes the output as it goes, so it needs somewhere to stream to
+  bool bounded = options.max_memory > 0;
+  if (bounded && (!stream || !stream->seekable() ||
+                  (options.keep_byte_order &&
+                   rom.byte_order() != ByteOrder::big))) {
+    report_error(prefix, error,
+                 "--max-memory needs a seekable big-endian output");
+    return false;
+  }
+
+  // for everything but encoding, which uses the codecs of the workers
+  std::unique_ptr<Codec> codec = Codec::create(options.format, options.level);
+  auto is_split = [&](size_t i) {
+    return codec->can_split() && options.split_threshold &&
+           rom.inEntry(i).size() >= options.split_threshold;
+  };
 
-  ThreadPool pool(cpu_count());
-  printf("Using %d threads\n", cpu_count());
+  // room for the worst case of every file, plus the segments of split ones;
+  // with bounded memory every result has its own buffer instead
+  size_t slab_size = 0;
   for (size_t i = 3; i < rom.entry_count(); i++) {
-    if (!compression_index[i]) continue;
+    if (!compression_index[i] || bounded) continue;
+    size_t size = rom.inEntry(i).size();
+    slab_size += codec->bound(size);
+    // and its upgrade
+    if (options.time_budget > 0) slab_size += codec->bound(size);
+    if (is_split(i)) {
+      slab_size += codec->segment_bound(size) + size / options.segment_size + 1;
+    }
+  }
+  OutputSlab slab(slab_size, options.huge_pages);
+  std::vector<Blob> compressed_data(rom.entry_count());
+
+  ThreadPool& pool = *context.pool;
+  JobGroup group(pool);
+  int threads = pool.size();
+
+  // Files whose bytes did not change since the reference ROM keep their
+  // compressed blob from it
+  std::vector<uint8_t> reused(rom.entry_count());
+  if (!options.reference.empty()) {
+    double reference_start = stats.now();
+    N64ROM reference(options.reference);
+    size_t count = std::min(rom.entry_count(), reference.entry_count());
+    std::atomic<size_t> reused_count(0);
+    for (size_t i = 3; i < count; i++) {
+      const auto& entry = rom.inEntry(i);
+      const auto& old = reference.inEntry(i);
+      if (!compression_index[i] || !old.is_compressed() ||
+          old.size() != entry.size() || old.endP < old.startP ||
+          old.endP > reference.in().size() ||
+          old.endP - old.startP > codec->bound(entry.size())) {
+        continue;
+      }
+      group.submit(entry.size(), [&, i] {
+        const auto& entry = rom.inEntry(i);
+        const auto& old = reference.inEntry(i);
+        const uint8_t* blob = reference.in().data() + old.startP;
+        size_t blob_size = old.endP - old.startP;
+
+        if (!decodes_to(*codec, blob, blob_size,
+                        rom.in().data() + entry.startP, entry.size())) {
+          return;
+        }
+        compressed_data[i] = slab.copy(blob, blob_size);
+        reused[i] = 1;
+        reused_count++;
 
+        EntryStats& e = stats.entry(i);
+        e.compressed = e.reused = true;
+        e.size = entry.size();
+        e.compressed_size = blob_size;
+      });
+    }
+    group.wait();
+    stats.phase("reference", reference_start, stats.now());
+    log_line(prefix, "Reference: %zu files unchanged", size_t(reused_count));
+  }
+
+  // Look up every file in the cache first, misses are encoded below
+  EntryCache* cache = context.cache;
+  DedupTable* dedup = context.dedup;
+  std::vector<std::string> cache_keys(rom.entry_count());
+  std::vector<uint8_t> cached(rom.entry_count());
+  if ((cache || dedup) && !bounded) {
+    double lookup_start = stats.now();
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      if (!compression_index[i] || reused[i]) continue;
+      const auto& entry = rom.inEntry(i);
+      group.submit(entry.size(), [&, i] {
+        const auto& entry = rom.inEntry(i);
+        cache_keys[i] = CompressionCache::key(
+            rom.in().data() + entry.startP, entry.size(),
+            int(options.format), codec->version(), options.level,
+            is_split(i) ? options.segment_size : 0);
+        if (!cache) return;
+        std::vector<uint8_t>& loaded = WorkerArena::get().output;
+        cached[i] = cache->load(cache_keys[i], loaded) &&
+                    loaded.size() <= codec->bound(entry.size());
+        if (cached[i]) {
+          compressed_data[i] = slab.copy(loaded.data(), loaded.size());
+          EntryStats& e = stats.entry(i);
+          e.compressed = e.cached = true;
+          e.level = options.level;
+          e.size = entry.size();
+          e.compressed_size = loaded.size();
+        }
+      });
+    }
+    group.wait();
+    stats.phase("cache_lookup", lookup_start, stats.now());
+  }
+
+  Completion done(rom.entry_count());
+  for (size_t i = 0; i < rom.entry_count(); i++) {
+    if (i < 3 || !compression_index[i] || cached[i] || reused[i]) done.mark(i);
+  }
+
+  // per entry, each written by the one worker that encodes it
+  std::vector<double> verify_cpu(rom.entry_count());
+  std::vector<uint8_t> verify_failed(rom.entry_count());
+
+  // Files another ROM of the batch already encodes are taken from it
+  std::vector<uint8_t> shared(rom.entry_count());
+  if (dedup) {
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      if (!compression_index[i] || cached[i] || reused[i]) continue;
+      shared[i] = !dedup->claim(
+          cache_keys[i], [&, i](const std::vector<uint8_t>* data) {
+            EntryStats& e = stats.entry(i);
+            e.compressed = e.shared = true;
+            e.level = options.level;
+            e.size = rom.inEntry(i).size();
+            if (data) {
+              // the table may drop data once this returns
+              compressed_data[i] = slab.copy(data->data(), data->size());
+              e.compressed_size = data->size();
+            } else {
+              // the same encoder failed the same input in the other ROM
+              verify_failed[i] = 1;
+            }
+            done.mark(i);
+          });
+    }
+  }
+
+  // Bounded memory gives every file the budget it needs until it is written,
+  // and starts jobs only while the files not written yet fit in it
+  size_t budget = 0;
+  std::vector<size_t> charge(rom.entry_count());
+  // straight from the system, so that they go back to it once written
+  std::vector<Buffer> results(bounded ? rom.entry_count() : 0);
+  if (bounded) {
+    rom.drop_input();
+    // the part of the output image that the checksum is taken from stays
+    size_t baseline = current_rss() + CHECKSUM_END;
+    if (baseline >= options.max_memory) {
+      report_error(prefix, error,
+                   "--max-memory must be more than the %zu MB the ROM takes "
+                   "before encoding",
+                   (baseline >> 20) + 1);
+      return false;
+    }
+    budget = options.max_memory - baseline;
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      if (!compression_index[i]) continue;
+      size_t size = rom.inEntry(i).size();
+      charge[i] = file_memory(options, size, codec->bound(size));
+    }
+  }
+
+  auto verify = [&](size_t i, const uint8_t* original) {
+    double start = stats.now();
+    verify_failed[i] =
+        !decodes_to(*codec, compressed_data[i].data, compressed_data[i].size,
+                    original, rom.inEntry(i).size());
+    verify_cpu[i] = stats.now() - start;
+  };
+
+  auto encode_file = [&](size_t i, double queued) {
     const auto& entry = rom.inEntry(i);
-    numThreads++;
-    pool.enqueue(compression_thread, rom.in().data() + entry.startP,
-                 entry.size(), i, std::ref(compressed_data[i]),
-                 std::ref(numThreads));
+    double start = stats.now();
+    WorkerArena& arena = WorkerArena::get();
+    const uint8_t* data = rom.in().data() + entry.startP;
+    Buffer input;
+    bool hit = false;
+    if (bounded) {
+      input = Buffer::allocate(entry.size());
+      rom.read_input(entry.startP, entry.size(), input.data());
+      data = input.data();
+      // looked up here, as a lookup up front would read every file at once
+      std::vector<uint8_t> loaded;
+      if (cache) {
+        cache_keys[i] =
+            CompressionCache::key(data, entry.size(), int(options.format),
+                                  codec->version(), options.level, 0);
+        hit = cache->load(cache_keys[i], loaded) &&
+              loaded.size() <= codec->bound(entry.size());
+      }
+      // encoded straight into the file's own buffer
+      results[i] = Buffer::allocate(codec->bound(entry.size()));
+      if (hit) {
+        memcpy(results[i].data(), loaded.data(), loaded.size());
+        results[i].resize(loaded.size());
+      }
+    }
+    Codec& encoder = arena.codec(options.format, options.level);
+    if (bounded) {
+      Buffer& out = results[i];
+      if (!hit) out.resize(encoder.encode(data, entry.size(), out.data()));
+      compressed_data[i] = {out.data(), out.size()};
+    } else {
+      uint8_t* out =
+          WorkerArena::reserve(arena.output, codec->bound(entry.size()));
+      compressed_data[i] =
+          slab.copy(out, encoder.encode(data, entry.size(), out));
+    }
+    double end = stats.now();
+
+    EntryStats& e = stats.entry(i);
+    e.compressed = true;
+    e.cached = hit;
+    e.size = entry.size();
+    e.compressed_size = compressed_data[i].size;
+    e.level = options.level;
+    e.worker = ThreadPool::worker_index();
+    e.segments = 1;
+    e.queued = queued;
+    e.start = start;
+    e.end = end;
+    e.cpu = end - start;
+    stats.span("entry " + std::to_string(i), i, e.worker, start, end);
+
+    if (options.verify && !hit) verify(i, data);
+    const Blob& blob = compressed_data[i];
+    // a file that does not decode is neither kept nor shared
+    if (verify_failed[i]) {
+      if (dedup) dedup->abandon(cache_keys[i]);
+    } else {
+      if (cache && !hit) cache->store(cache_keys[i], blob.data, blob.size);
+      if (dedup) dedup->publish(cache_keys[i], blob.data, blob.size);
+    }
+    if (bounded) arena.trim();
+    done.mark(i);
+  };
+
+  // the last segment to finish joins the file
+  auto finish_split = [&](SplitFile& split) {
+    size_t size = rom.inEntry(split.index).size();
+    uint8_t* out = WorkerArena::reserve(WorkerArena::get().output,
+                                        codec->bound(size));
+    // a segment that found the slab full has no data, and the ROM fails
+    if (!slab.full()) {
+      compressed_data[split.index] = slab.copy(
+          out, codec->join_segments(split.segments.data(),
+                                    split.segment_sizes.data(),
+                                    split.segments.size(), out));
+    }
+
+    EntryStats& e = stats.entry(split.index);
+    e.compressed = true;
+    e.size = size;
+    e.compressed_size = compressed_data[split.index].size;
+    e.level = options.level;
+    e.segments = split.segment_sizes.size();
+    e.queued = split.queued;
+    e.start = split.start;
+    e.end = stats.now();
+    for (double cpu : split.segment_cpu) e.cpu += cpu;
+
+    if (options.verify) {
+      verify(split.index,
+             rom.in().data() + rom.inEntry(split.index).startP);
+    }
+    const Blob& blob = compressed_data[split.index];
+    if (verify_failed[split.index]) {
+      if (dedup) dedup->abandon(cache_keys[split.index]);
+    } else {
+      if (cache) cache->store(cache_keys[split.index], blob.data, blob.size);
+      if (dedup) {
+        dedup->publish(cache_keys[split.index], blob.data, blob.size);
+      }
+    }
+    done.mark(split.index);
+  };
+
+  auto encode_segment = [&](SplitFile& file, size_t s, size_t start,
+                            size_t end, double queued) {
+    const uint8_t* data = rom.in().data() + rom.inEntry(file.index).startP;
+    double begin = stats.now();
+    WorkerArena& arena = WorkerArena::get();
+    uint8_t* out =
+        WorkerArena::reserve(arena.output, codec->segment_bound(end - start));
+    size_t size = arena.codec(options.format, options.level)
+                      .encode_segment(data, start, end, out);
+    file.segments[s] = slab.copy(out, size).data;
+    double finish = stats.now();
+
+    file.segment_cpu[s] = finish - begin;
+    file.queued = queued;
+    // keep the earliest start of all segments
+    double first = file.start;
+    while (begin < first && !file.start.compare_exchange_weak(first, begin))
+      ;
+    stats.span("entry " + std::to_string(file.index) + " segment " +
+                   std::to_string(s),
+               file.index, ThreadPool::worker_index(), begin, finish);
+    if (--file.remaining == 0) finish_split(file);
+  };
+
+  std::deque<SplitFile> split_files;
+  for (size_t i = 3; i < rom.entry_count(); i++) {
+    if (compression_index[i] && !cached[i] && !reused[i] && !shared[i] &&
+        is_split(i)) {
+      split_files.emplace_back();
+      split_files.back().index = i;
+    }
   }
 
-  printf("Compressing %d files\n", numThreads.load());
-  while (numThreads > 0) {
-    printf("~%d threads remaining\n", numThreads.load());
-    fflush(stdout);
-    std::this_thread::sleep_for(std::chrono::seconds(5));
+  // Collect the jobs first so they can be started largest first
+  struct Job {
+    size_t cost;
+    // called with the time the job was queued
+    std::function<void(double)> run;
+    // charged against the budget of bounded memory
+    size_t memory = 0;
+  };
+  std::vector<Job> jobs;
+  int files = 0;
+  size_t segment_count = 0;
+  for (auto& split : split_files) {
+    const auto& entry = rom.inEntry(split.index);
+    for (size_t start = 0; start < entry.size();
+         start += options.segment_size) {
+      size_t end = std::min<size_t>(start + options.segment_size, entry.size());
+      split.segment_sizes.push_back(end - start);
+    }
+    split.segments.resize(split.segment_sizes.size());
+    split.segment_cpu.resize(split.segment_sizes.size());
+    split.remaining = split.segments.size();
+    segment_count += split.segments.size();
+    files++;
+
+    size_t start = 0;
+    for (size_t s = 0; s < split.segments.size(); s++) {
+      size_t end = start + split.segment_sizes[s];
+      SplitFile* file = &split;
+      jobs.push_back(
+          {end - start, [&encode_segment, file, s, start, end](double queued) {
+             encode_segment(*file, s, start, end, queued);
+           }});
+      start = end;
+    }
   }
 
-  /* Setup for copying to outROM */
-  rom.out().resize(COMPSIZE);
+  std::vector<size_t> batch;
+  size_t batch_cost = 0;
+  size_t batch_memory = 0;
+  auto flush_batch = [&] {
+    if (batch.empty()) return;
+    jobs.push_back({batch_cost,
+                    [&encode_file, batch](double queued) {
+                      for (size_t i : batch) encode_file(i, queued);
+                    },
+                    batch_memory});
+    batch.clear();
+    batch_cost = 0;
+    batch_memory = 0;
+  };
+
+  size_t split_index = 0;
+  for (size_t i = 3; i < rom.entry_count(); i++) {
+    if (!compression_index[i] || cached[i] || reused[i] || shared[i]) {
+      continue;
+    }
+    if (split_index < split_files.size() &&
+        split_files[split_index].index == i) {
+      split_index++;
+      continue;
+    }
+
+    const auto& entry = rom.inEntry(i);
+    files++;
+    if (entry.size() < options.tiny_file) {
+      batch.push_back(i);
+      batch_cost += entry.size();
+      batch_memory += charge[i];
+      if (batch_cost >= options.batch_size) flush_batch();
+      continue;
+    }
+
+    // jobs of bounded memory have to be in table order, batches too
+    if (bounded) flush_batch();
+    jobs.push_back({entry.size(),
+                    [&encode_file, i](double queued) {
+                      encode_file(i, queued);
+                    },
+                    charge[i]});
+  }
+  flush_batch();
+
+  // Bounded memory starts the jobs in table order instead, as their results
+  // are written and free the budget
+  if (!bounded) {
+    std::stable_sort(
+        jobs.begin(), jobs.end(),
+        [](const Job& a, const Job& b) { return a.cost > b.cost; });
+  }
+
+  double compression_start = stats.now();
+  size_t next_job = 0;
+  size_t memory_in_use = 0;
+  size_t over_budget = 0;
+  auto submit_jobs = [&] {
+    for (; next_job < jobs.size(); next_job++) {
+      Job& job = jobs[next_job];
+      if (bounded && memory_in_use + job.memory > budget) {
+        // a job that does not fit even alone runs once nothing else does
+        if (memory_in_use) break;
+        over_budget++;
+      }
+      memory_in_use += job.memory;
+      double queued = stats.now();
+      group.submit(job.cost, [&job, queued] { job.run(queued); });
+    }
+  };
+  submit_jobs();
+
+  log_line(prefix, "Compressing %d files to %s in %zu jobs", files,
+           format_name(options.format), jobs.size());
+  if (bounded) {
+    log_line(prefix, "Max memory: %.1f MB left for files in flight",
+             budget / 1048576.0);
+  }
+  if (!split_files.empty()) {
+    log_line(prefix, "Split %zu large files into %zu segments",
+             split_files.size(), segment_count);
+  }
+
+  // With a time budget, the files encoded above move to stronger levels as
+  // far as the budget allows once all of them are done. Whatever is still
+  // running when the time is up keeps its fast result.
+  enum : uint8_t {
+    upgrade_pending,
+    upgrade_running,
+    upgrade_done,
+    upgrade_dropped
+  };
+  std::vector<int> planned(rom.entry_count(), options.level);
+  std::vector<double> planned_cpu(rom.entry_count());
+  std::vector<std::atomic<uint8_t>> upgrade_state(rom.entry_count());
+  // written by the upgrade before it is done, read only after
+  std::vector<Blob> upgrade_data(rom.entry_count());
+  std::vector<double> upgrade_cpu(rom.entry_count());
+  std::vector<uint8_t> upgrade_failed(rom.entry_count());
+  // set once no upgrade still running can be used, so they stop early
+  std::atomic<bool> cancel_upgrades(false);
+  Completion upgraded(rom.entry_count());
+  JobGroup upgrades(pool);
+  // leaves as much time for writing the output as loading the input took
+  double upgrade_deadline = options.time_budget * 1e3 - rom.load_time();
+  double upgrade_start = 0;
+
+  auto upgrade_file = [&](size_t i) {
+    const auto& entry = rom.inEntry(i);
+    const uint8_t* data = rom.in().data() + entry.startP;
+    double start = stats.now();
+    WorkerArena& arena = WorkerArena::get();
+    Codec& encoder = arena.codec(options.format, planned[i]);
+    std::string key;
+    if (cache) {
+      key = CompressionCache::key(data, entry.size(), int(options.format),
+                                  encoder.version(), planned[i], 0);
+    }
+    bool hit = cache && cache->load(key, arena.output) &&
+               arena.output.size() <= codec->bound(entry.size());
+    if (hit) {
+      upgrade_data[i] = slab.copy(arena.output.data(), arena.output.size());
+    } else {
+      uint8_t* out =
+          WorkerArena::reserve(arena.output, codec->bound(entry.size()));
+      encoder.set_cancel(&cancel_upgrades);
+      size_t size = encoder.encode(data, entry.size(), out);
+      encoder.set_cancel(nullptr);
+      // cancelled, it stays running and take_upgrade counts it as late
+      if (!size) return;
+      upgrade_data[i] = slab.copy(out, size);
+    }
+    double end = stats.now();
+    upgrade_cpu[i] = end - start;
+    stats.span("entry " + std::to_string(i) + " level " +
+                   std::to_string(planned[i]),
+               i, ThreadPool::worker_index(), start, end);
+    if (options.verify) {
+      upgrade_failed[i] = !decodes_to(*codec, upgrade_data[i].data,
+                                      upgrade_data[i].size, data, entry.size());
+    }
+    if (cache && !hit && !upgrade_failed[i]) {
+      cache->store(key, upgrade_data[i].data, upgrade_data[i].size);
+    }
+    uint8_t running = upgrade_running;
+    upgrade_state[i].compare_exchange_strong(running, upgrade_done);
+  };
 
-  size_t write_pointer = rom.inEntry(3).startP;
-  memset(rom.out().data() + write_pointer, 0, rom.out().size() - write_pointer);
+  if (options.time_budget > 0) {
+    group.wait();
+    upgrade_start = stats.now();
+    std::vector<Upgrade> candidates;
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      const EntryStats& e = stats.entry(i);
+      if (!e.compressed || e.cached || e.reused || e.shared) continue;
+      for (int level = options.level + 1; level <= CODEC_MAX_LEVEL; level++) {
+        candidates.push_back(
+            {i, level, e.cpu * level_cpu[level] / level_cpu[options.level],
+             e.compressed_size *
+                 (1 - level_size[level] / level_size[options.level])});
+      }
+    }
+    double cpu = plan_upgrades(candidates, upgrade_deadline - upgrade_start,
+                               threads, planned, planned_cpu);
+
+    size_t count = 0;
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      if (planned[i] == options.level) continue;
+      count++;
+      size_t cost = size_t(rom.inEntry(i).size() * level_cpu[planned[i]]);
+      upgrades.submit(cost, [&, i] {
+        uint8_t pending = upgrade_pending;
+        if (!cancel_upgrades && stats.now() < upgrade_deadline &&
+            upgrade_state[i].compare_exchange_strong(pending,
+                                                     upgrade_running)) {
+          upgrade_file(i);
+        }
+        upgraded.mark(i);
+      });
+    }
+    log_line(prefix,
+             "Time budget: %.0f ms left, upgrading %zu files with about "
+             "%.0f ms of CPU",
+             std::max(upgrade_deadline - upgrade_start, 0.0), count, cpu);
+  }
+
+  // the upgrade of file i if it finished in time
+  size_t upgrade_count = 0;
+  size_t upgrade_late = 0;
+  size_t upgrade_saved = 0;
+  auto take_upgrade = [&](size_t i) {
+    double left = upgrade_deadline - stats.now();
+    if (left > 0) {
+      upgraded.wait_for(i, std::chrono::duration<double, std::milli>(left));
+    }
+    if (upgrade_state[i].exchange(upgrade_dropped) != upgrade_done) {
+      // the deadline has passed, so no other upgrade can be used either
+      cancel_upgrades = true;
+      upgrade_late++;
+      return;
+    }
+    upgrade_count++;
+    EntryStats& e = stats.entry(i);
+    e.cpu += upgrade_cpu[i];
+    if (upgrade_data[i].size < compressed_data[i].size) {
+      // only the result that is placed counts for --verify
+      if (upgrade_failed[i]) verify_failed[i] = 1;
+      upgrade_saved += compressed_data[i].size - upgrade_data[i].size;
+      compressed_data[i] = upgrade_data[i];
+      e.compressed_size = upgrade_data[i].size;
+      e.level = planned[i];
+    }
+  };
+
+  // Lay the files out in table order while the rest are still compressing.
+  // When streaming to a seekable file, each one is written out right away
+  // and the header is patched at the end; otherwise they are collected in
+  // the output image and written once.
+  ByteOrder file_order =
+      options.keep_byte_order ? rom.byte_order() : ByteOrder::big;
+  if (file_order != ByteOrder::big && stream) {
+    log_line(prefix, "Writing %s output once compression is done",
+             byte_order_name(file_order));
+  }
+  bool streaming = stream && stream->seekable() &&
+                   file_order == ByteOrder::big && !options.verify_rom;
+
+  double layout_start = stats.now();
+  size_t first_file = rom.inEntry(3).startP;
+  size_t write_pointer = first_file;
+  if (streaming) stream->write(rom.out().data(), first_file);
+
+  // false once the ROM does not fit
+  auto place = [&](const uint8_t* data, size_t size) {
+    if (write_pointer + size > COMPSIZE) {
+      report_error(prefix, error, "compressed ROM is larger than %x bytes",
+                   COMPSIZE);
+      return false;
+    }
+    if (streaming) {
+      stream->write(data, size);
+      // keep what the checksum needs
+      if (write_pointer < CHECKSUM_END) {
+        memcpy(rom.out().data() + write_pointer, data,
+               std::min<size_t>(size, CHECKSUM_END - write_pointer));
+      }
+    } else {
+      memcpy(rom.out().data() + write_pointer, data, size);
+    }
+    write_pointer += size;
+    return true;
+  };
+
+  // uncompressed files go through it piece by piece in bounded memory
+  std::vector<uint8_t> chunk(bounded ? 0x10000 : 0);
 
   /* Copy to outROM loop */
-  for (size_t i = 3; i < rom.entry_count(); i++) {
+  bool placed = true;
+  for (size_t i = 3; placed && i < rom.entry_count(); i++) {
     const auto& entry = rom.inEntry(i);
     auto& outentry = rom.outEntry(i);
 
@@ -84,32 +885,519 @@ void compress(const std::string& name, const std::string& outname) {
     outentry.startP = write_pointer;
 
     if (compression_index[i]) {
-      memcpy(rom.out().data() + write_pointer, compressed_data[i].data(),
-             compressed_data[i].size());
-      outentry.endP = outentry.startP + compressed_data[i].size();
-      write_pointer = outentry.endP;
+      while (!done.wait_for(i, std::chrono::seconds(5))) {
+        log_line(prefix, "~%zu jobs remaining", pool.pending());
+        fflush(stdout);
+      }
+      if (planned[i] != options.level) take_upgrade(i);
+      placed = place(compressed_data[i].data, compressed_data[i].size);
+      outentry.endP = write_pointer;
+      if (bounded) {
+        results[i] = Buffer();
+        memory_in_use -= charge[i];
+        submit_jobs();
+      }
+    } else if (bounded) {
+      for (size_t offset = 0; placed && offset < entry.size();
+           offset += chunk.size()) {
+        size_t size = std::min(chunk.size(), entry.size() - offset);
+        rom.read_input(entry.startP + offset, size, chunk.data());
+        placed = place(chunk.data(), size);
+      }
     } else {
-      memcpy(rom.out().data() + write_pointer, rom.in().data() + entry.startP,
-             entry.size());
-      write_pointer += entry.size();
+      placed = place(rom.in().data() + entry.startP, entry.size());
     }
   }
-  printf("Final size %zx bytes\n", write_pointer);
+  group.wait();
+  // every upgrade that can still be used has been taken
+  cancel_upgrades = true;
+  // files of other ROMs may still be on their way to dummy entries
+  if (dedup) done.wait_all();
 
-  rom.save(outname);
+  // Upgrades that ran late use everything above until they notice they were
+  // cancelled, so a ROM that fails from here on waits for them first
+  auto fail = [&] {
+    upgrades.wait();
+    return false;
+  };
+  if (!placed) return fail();
+  if (slab.full()) {
+    report_error(prefix, error, "output slab of %zx bytes is full",
+                 slab.capacity());
+    return fail();
+  }
+
+  stats.phase("compression", compression_start, stats.now(), true);
+  stats.phase("layout", layout_start, stats.now());
+  if (options.time_budget > 0) {
+    stats.phase("upgrade", upgrade_start, stats.now(), true);
+    log_line(prefix,
+             "Time budget: upgraded %zu files, %zu kept their fast result, "
+             "%zx bytes saved",
+             upgrade_count, upgrade_late, upgrade_saved);
+  }
+
+  if (options.verify) {
+    // a file that fails is neither cached nor shared, and the output is not
+    // written
+    double cpu = 0;
+    double encode_cpu = 0;
+    size_t verified = 0;
+    size_t failed = 0;
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      if (verify_failed[i]) {
+        fprintf(stderr, "%sError: file %zu does not decode to its input\n",
+                prefix.c_str(), i);
+        failed++;
+      }
+      const EntryStats& e = stats.entry(i);
+      if (!e.compressed || e.cached || e.reused || e.shared) continue;
+      cpu += verify_cpu[i];
+      encode_cpu += e.cpu;
+      verified++;
+    }
+    if (failed) {
+      report_error(prefix, error, "%zu files do not decode to their input",
+                   failed);
+      return fail();
+    }
+    log_line(prefix, "Verified %zu files in %.1f ms (%.1f%% of encoding)",
+             verified, cpu, encode_cpu ? 100.0 * cpu / encode_cpu : 0.0);
+  }
+
+  if (options.split_compare && !split_files.empty()) {
+    size_t split_bytes = 0;
+    size_t whole_bytes = 0;
+    for (auto& split : split_files) {
+      const auto& entry = rom.inEntry(split.index);
+      const auto& outentry = rom.outEntry(split.index);
+      split_bytes += outentry.endP - outentry.startP;
+      whole_bytes +=
+          yaz0_encode(rom.in().data() + entry.startP, entry.size()).size();
+    }
+    log_line(prefix, "Split files: %zx bytes, %zx bytes encoded whole (%+.3f%%)",
+             split_bytes, whole_bytes,
+             100.0 * (double(split_bytes) - double(whole_bytes)) / whole_bytes);
+  }
+
+  log_line(prefix, "Final size %zx bytes", write_pointer);
+  size_t encoded_size = 0;
+  size_t encoded_compressed = 0;
+  double encoded_cpu = 0;
+  for (size_t i = 3; i < rom.entry_count(); i++) {
+    const EntryStats& e = stats.entry(i);
+    if (!e.compressed || e.cached || e.reused || e.shared) continue;
+    encoded_size += e.size;
+    encoded_compressed += e.compressed_size;
+    encoded_cpu += e.cpu;
+  }
+  if (encoded_size) {
+    std::string levels = "Level " + std::to_string(options.level);
+    if (options.time_budget > 0) {
+      levels = "Levels " + std::to_string(options.level) + " to " +
+               std::to_string(CODEC_MAX_LEVEL);
+    }
+    log_line(prefix, "%s: %.1f MB/s per thread, ratio %.4f", levels.c_str(),
+             encoded_size / encoded_cpu / 1e3,
+             double(encoded_compressed) / encoded_size);
+  }
+
+  rom.out().resize(COMPSIZE);
+  rom.writeTable();
+
+  if (options.verify_rom) {
+    // read everything back through the table just written, the way a game
+    // would
+    double verify_start = stats.now();
+    std::atomic<size_t> failed(0);
+    for (size_t i = 3; i < rom.entry_count(); i++) {
+      const auto& entry = rom.inEntry(i);
+      if (!entry.startV) continue;
+      group.submit(entry.size(), [&, i] {
+        const auto& entry = rom.inEntry(i);
+        N64ROM::table_entry out(
+            rom.out().data(),
+            rom.table_offset() + sizeof(N64ROM::table_entry) * i);
+        const uint8_t* original = rom.in().data() + entry.startP;
+        const uint8_t* data = rom.out().data() + out.startP;
+        bool ok = out.startV == entry.startV && out.endV == entry.endV;
+        if (ok && out.is_compressed()) {
+          ok = out.endP > out.startP && out.endP <= COMPSIZE &&
+               decodes_to(*codec, data, out.endP - out.startP,
+                          original, entry.size());
+        } else if (ok) {
+          ok = out.startP + entry.size() <= COMPSIZE &&
+               !memcmp(data, original, entry.size());
+        }
+        if (!ok) {
+          fprintf(stderr, "%sError: file %zu of the output does not match\n",
+                  prefix.c_str(), i);
+          failed++;
+        }
+      });
+    }
+    group.wait();
+    if (failed) {
+      report_error(prefix, error, "%zu files of the output do not match",
+                   size_t(failed));
+      return fail();
+    }
+    double verify_end = stats.now();
+    stats.phase("verify_rom", verify_start, verify_end);
+    log_line(prefix, "Verified the output image in %.1f ms",
+             verify_end - verify_start);
+  }
+
+  double crc_start = stats.now();
+  rom.fix_crc();
+  double save_start = stats.now();
+  stats.phase("fix_crc", crc_start, save_start);
+
+  if (!stream) {
+    rom.write(outname, file_order);
+  } else if (streaming) {
+    // the rest of the image is still zero
+    stream->write(rom.out().data() + write_pointer, COMPSIZE - write_pointer);
+    stream->write_at(0, rom.out().data(), first_file);
+  } else {
+    convert_byte_order(rom.out().data(), COMPSIZE, file_order);
+    stream->write(rom.out().data(), COMPSIZE);
+  }
+  if (stream) stream->close();
+  if (stream && !stream->ok()) {
+    report_error(prefix, error, "cannot write the output");
+    return fail();
+  }
+  stats.phase("save", save_start, stats.now());
+  // upgrades that ran late still use the slab and the tables above, but they
+  // were cancelled and stop within a few KB of input
+  upgrades.wait();
+
+  AllocationStats allocations;
+  allocations.heap = heap_allocations() - heap_start;
+  allocations.arena = arena_growth - arena_start;
+  allocations.slab_used = slab.used();
+  allocations.slab_capacity = slab.capacity();
+  allocations.peak_rss = peak_rss();
+  if (bounded) {
+    log_line(prefix, "Peak RSS %.1f MB of %.1f MB allowed",
+             allocations.peak_rss / 1048576.0, options.max_memory / 1048576.0);
+    if (over_budget) {
+      log_line(prefix, "%zu files needed more than the limit on their own",
+               over_budget);
+    }
+  }
+  stats.set_allocations(allocations);
+  if (!options.stats_json.empty()) stats.write_json(options.stats_json, threads);
+  if (!options.trace.empty()) stats.write_trace(options.trace, threads);
+  return true;
+}
+
+void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [options] file [outfile]\n"
+          "       %s [options] --batch in out [in out ...]\n"
+          "       %s [options] --manifest FILE\n"
+          "       %s [options] --serve SOCKET\n"
+          "  --split-threshold BYTES  split files at least this large into "
+          "segments (0 disables)\n"
+          "  --segment-size BYTES     size of each segment\n"
+          "  --split-compare          report the ratio cost of splitting\n"
+          "  --level N                0 greedy (default), 1 lazy, 2 optimal "
+          "parse; higher is smaller and slower\n"
+          "  --time-budget SECONDS    encode at --level first, then move "
+          "files to stronger levels while the run can still finish in "
+          "time\n"
+          "  --format NAME            Yaz0 (default), Yay0 or MIO0; only "
+          "Yaz0 splits files, and the game only reads Yaz0\n"
+          "  --cache DIR              reuse compressed files across runs\n"
+          "  --cache-size MB          evict old cache entries above this "
+          "size\n"
+          "  --reference ROM          copy unchanged files from this "
+          "compressed ROM\n"
+          "  --huge-pages             back the output image with huge pages\n"
+          "  --keep-byte-order        write the output in the byte order of "
+          "the input (.v64, .n64) instead of .z64\n"
+          "  --verify                 decode every file after encoding it "
+          "and compare it with the input\n"
+          "  --verify-rom             decode the finished image through its "
+          "table and compare it with the input\n"
+          "  --stream                 write files in order while compressing; "
+          "outfile may be - for stdout\n"
+          "  --stats-json FILE        write per-file timings and ratios\n"
+          "  --trace FILE             write a Chrome trace of the run\n"
+          "  --batch                  compress several ROMs given as input "
+          "and output pairs, sharing threads and identical files\n"
+          "  --manifest FILE          same, with one input and output pair "
+          "per line\n"
+          "  --batch-roms N           ROMs compressed at the same time "
+          "(default 4)\n"
+          "  --serve SOCKET           run as a daemon taking jobs on this Unix "
+          "domain socket; see compressor_client\n"
+          "  --memory-cache MB        size of the daemon's in-memory cache of "
+          "compressed files (default 512)\n"
+          "  --threads N              worker threads (default: one per CPU "
+          "of a cgroup quota, else the allowed CPUs plus 2)\n"
+          "  --pin MODE               bind workers to CPUs: none (default), "
+          "cores for one per physical core, node for one NUMA node\n"
+          "  --max-memory MB          keep the whole run within this much "
+          "memory; streams the output, which must be seekable, and does "
+          "not split files\n",
+          argv0, argv0, argv0, argv0);
+}
+
+// Reads whitespace separated input and output pairs; # starts a comment
+static bool read_manifest(
+    const std::string& file_name,
+    std::vector<std::pair<std::string, std::string>>& roms) {
+  std::ifstream file(file_name);
+  if (!file) {
+    fprintf(stderr, "Error: cannot open manifest %s\n", file_name.c_str());
+    return false;
+  }
+  std::string line;
+  for (int number = 1; std::getline(file, line); number++) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string in, out, extra;
+    if (!(fields >> in)) continue;
+    if (!(fields >> out) || (fields >> extra)) {
+      fprintf(stderr, "Error: %s:%d: expected an input and an output\n",
+              file_name.c_str(), number);
+      return false;
+    }
+    roms.emplace_back(in, out);
+  }
+  return true;
 }
 
 int main(int argc, char** argv) {
-  if (argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: %s file [outfile]", argv[0]);
+  Options options;
+  std::vector<std::string> files;
+  std::string manifest;
+  bool batch = false;
+  std::string serve_path;
+  uint64_t memory_cache = 512ull << 20;
+  int threads = 0;
+  PinMode pin = PinMode::none;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--split-threshold" && has_value) {
+      options.split_threshold = strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "--segment-size" && has_value) {
+      options.segment_size = strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "--cache" && has_value) {
+      options.cache_dir = argv[++i];
+    } else if (arg == "--cache-size" && has_value) {
+      options.cache_size = strtoull(argv[++i], nullptr, 0) << 20;
+    } else if (arg == "--reference" && has_value) {
+      options.reference = argv[++i];
+    } else if (arg == "--stats-json" && has_value) {
+      options.stats_json = argv[++i];
+    } else if (arg == "--trace" && has_value) {
+      options.trace = argv[++i];
+    } else if (arg == "--manifest" && has_value) {
+      manifest = argv[++i];
+      batch = true;
+    } else if (arg == "--batch-roms" && has_value) {
+      options.batch_roms = atoi(argv[++i]);
+    } else if (arg == "--serve" && has_value) {
+      serve_path = argv[++i];
+    } else if (arg == "--memory-cache" && has_value) {
+      memory_cache = strtoull(argv[++i], nullptr, 0) << 20;
+    } else if (arg == "--max-memory" && has_value) {
+      options.max_memory = strtoull(argv[++i], nullptr, 0) << 20;
+      if (!options.max_memory) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--threads" && has_value) {
+      threads = atoi(argv[++i]);
+      if (threads < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--pin" && has_value) {
+      if (!parse_pin_mode(argv[++i], &pin)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--stream") {
+      options.stream = true;
+    } else if (arg == "--huge-pages") {
+      options.huge_pages = true;
+    } else if (arg == "--keep-byte-order") {
+      options.keep_byte_order = true;
+    } else if (arg == "--verify") {
+      options.verify = true;
+    } else if (arg == "--verify-rom") {
+      options.verify_rom = true;
+    } else if (arg == "--level" && has_value) {
+      options.level = atoi(argv[++i]);
+      if (options.level < 0 || options.level > CODEC_MAX_LEVEL) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--time-budget" && has_value) {
+      options.time_budget = strtod(argv[++i], nullptr);
+      if (!(options.time_budget > 0)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--format" && has_value) {
+      if (!parse_format(argv[++i], &options.format)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--split-compare") {
+      options.split_compare = true;
+    } else if (arg.compare(0, 2, "--") == 0 || (arg == "-" && files.empty())) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  std::vector<std::pair<std::string, std::string>> roms;
+  if (!serve_path.empty()) {
+    // every job brings its own ROM and output
+    if (batch || !files.empty() || options.stream ||
+        !options.stats_json.empty() || !options.trace.empty() ||
+        options.batch_roms < 1) {
+      usage(argv[0]);
+      return 1;
+    }
+  } else if (batch) {
+    if (files.size() % 2 || options.batch_roms < 1) {
+      usage(argv[0]);
+      return 1;
+    }
+    for (size_t i = 0; i < files.size(); i += 2) {
+      roms.emplace_back(files[i], files[i + 1]);
+    }
+    if (!manifest.empty() && !read_manifest(manifest, roms)) return 1;
+    for (const auto& rom : roms) {
+      if (rom.second == "-") {
+        fprintf(stderr, "Error: batch outputs cannot be stdout\n");
+        return 1;
+      }
+    }
+    if (!options.stats_json.empty() || !options.trace.empty()) {
+      fprintf(stderr, "Error: --stats-json and --trace need a single ROM\n");
+      return 1;
+    }
+  } else if (files.size() == 1 || files.size() == 2) {
+    std::string name = files[0];
+    std::string outname =
+        files.size() == 2
+            ? files[1]
+            : (name.substr(0, name.find_last_of('.')) + "-comp.z64");
+    roms.emplace_back(name, outname);
+  }
+  if ((roms.empty() && serve_path.empty()) || !options.segment_size) {
+    usage(argv[0]);
     return 1;
   }
+  if (options.max_memory) {
+    // each of these needs whole images or results of every file at once
+    if (batch || !serve_path.empty() || !options.reference.empty() ||
+        options.verify_rom || options.time_budget > 0) {
+      fprintf(stderr,
+              "Error: --max-memory works on a single ROM, without "
+              "--reference, --verify-rom or --time-budget\n");
+      return 1;
+    }
+    options.stream = true;
+    options.split_threshold = 0;
+  }
 
-  std::string name = argv[1];
-  std::string outname =
-      argc == 3 ? argv[2]
-                : (name.substr(0, name.find_last_of('.')) + "-comp.z64");
+  // opened first, so that nothing else is printed to stdout when it is the
+  // destination
+  auto open_stream = [&](const std::string& outname) {
+    std::unique_ptr<OutputFile> stream;
+    if (options.stream) stream.reset(new OutputFile(outname));
+    return stream;
+  };
+  std::unique_ptr<OutputFile> first_stream;
+  if (!batch) first_stream = open_stream(roms[0].second);
 
-  compress(name, outname);
-  return 0;
+  bool requested = threads > 0;
+  std::string reason = "as requested";
+  if (!requested) threads = cpu_count(cpu_limits(), &reason);
+  std::string pinning;
+  std::vector<int> cpus = pin_plan(pin, &pinning);
+  if (pin != PinMode::none && cpus.empty()) {
+    fprintf(stderr, "Warning: the CPU topology is unknown, not pinning\n");
+  }
+  if (!cpus.empty()) {
+    // more threads than CPUs to pin them to would share them
+    if (!requested && threads > int(cpus.size())) {
+      threads = int(cpus.size());
+      reason += ", at most one per pinned CPU";
+    }
+    reason += "; pinned to " + pinning;
+  }
+  ThreadPool pool(threads, [&cpus](size_t i) {
+    if (cpus.empty()) return;
+    int cpu = cpus[i % cpus.size()];
+    if (!pin_thread(cpu)) {
+      fprintf(stderr, "Warning: cannot pin worker %zu to CPU %d\n", i, cpu);
+    }
+  });
+  printf("Using %d threads (%s)\n", threads, reason.c_str());
+
+  std::unique_ptr<CompressionCache> cache;
+  if (!options.cache_dir.empty()) {
+    cache.reset(new CompressionCache(options.cache_dir, options.cache_size));
+  }
+  DedupTable dedup;
+  Context context{&pool, cache.get(), roms.size() > 1 ? &dedup : nullptr,
+                  batch};
+
+  std::atomic<bool> failed(false);
+  if (!serve_path.empty()) {
+#ifndef _WIN32
+    // the memory cache sits in front of the disk cache, if there is one
+    MemoryCache memory(memory_cache, cache.get());
+    context.cache = &memory;
+    context.batch = true;
+    failed =
+        serve(serve_path, options, context, memory, options.batch_roms) != 0;
+#else
+    fprintf(stderr, "Error: --serve needs Unix domain sockets\n");
+    failed = true;
+#endif
+  } else if (!batch) {
+    failed = !compress(roms[0].first, roms[0].second, options, context,
+                       std::move(first_stream));
+  } else {
+    // every ROM takes the next one from the list once it is written, and all
+    // of their files go through the same pool
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> drivers;
+    size_t count = std::min<size_t>(options.batch_roms, roms.size());
+    for (size_t d = 0; d < count; d++) {
+      drivers.emplace_back([&] {
+        for (size_t i; (i = next++) < roms.size();) {
+          if (!compress(roms[i].first, roms[i].second, options, context,
+                        open_stream(roms[i].second))) {
+            failed = true;
+          }
+        }
+      });
+    }
+    for (auto& driver : drivers) driver.join();
+    printf("Batch: %zu ROMs, %zu files shared between them\n", roms.size(),
+           dedup.shared());
+  }
+
+  if (cache) {
+    cache->evict();
+    printf("Cache: %zu hits, %zu misses\n", cache->hits(), cache->misses());
+  }
+  return failed ? 1 : 0;
 }
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "ThreadPool.h"
+#include "buffer.h"
+#include "cache.h"
+#include "codec.h"
+#include "dedup.h"
+
+struct Options {
+  // files at least this large are split into segments encoded in parallel
+  size_t split_threshold = 0x80000;
+  size_t segment_size = 0x40000;
+  // also encode split files whole and report what splitting cost
+  bool split_compare = false;
+  // files smaller than this are encoded in batches of about batch_size bytes
+  // to save per-job overhead
+  size_t tiny_file = 0x4000;
+  size_t batch_size = 0x40000;
+  // persistent cache of compressed files, disabled when empty
+  std::string cache_dir;
+  uint64_t cache_size = 1024ull << 20;
+  bool huge_pages = false;
+  // write the output in the byte order of the input instead of big-endian
+  bool keep_byte_order = false;
+  // write every file as soon as all files before it are done
+  bool stream = false;
+  // previous compressed ROM whose files are copied when unchanged, disabled
+  // when empty
+  std::string reference;
+  // per-file statistics and a Chrome trace, disabled when empty
+  std::string stats_json;
+  std::string trace;
+  // ROMs compressed at the same time in batch mode
+  int batch_roms = 4;
+  // format of the compressed files; the game itself only reads Yaz0
+  Format format = Format::yaz0;
+  // 0 greedy, 1 lazy, 2 optimal parse
+  int level = 0;
+  // decode every compressed file again and compare it with the input
+  bool verify = false;
+  // check the finished image through its table once more; keeps the whole
+  // image in memory, so it turns off streaming
+  bool verify_rom = false;
+  // seconds the whole run may take; files are encoded at level first and
+  // then moved to stronger levels while time is left, 0 disables
+  double time_budget = 0;
+  // bytes the whole run may take, 0 for no limit; reads files from the input
+  // as they are encoded, streams the output and starts jobs only while the
+  // results waiting to be written fit
+  uint64_t max_memory = 0;
+};
+
+// Everything the ROMs of one run share
+struct Context {
+  ThreadPool* pool;
+  // null when disabled
+  EntryCache* cache;
+  // null unless several ROMs are compressed
+  DedupTable* dedup;
+  // prefix every message with the ROM name
+  bool batch;
+};
+
+// Compresses the ROM name to outname, or to stream when given. image, if not
+// empty, holds the ROM and name only labels it. Returns false if the ROM
+// cannot be compressed, after printing why and storing it in error if given;
+// the ROM may then be partly written to stream.
+bool compress(const std::string& name, const std::string& outname,
+              const Options& options, const Context& context,
+              std::unique_ptr<OutputFile> stream, Buffer image = Buffer(),
+              std::string* error = nullptr);
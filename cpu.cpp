@@ -0,0 +1,220 @@
+#include "cpu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+// first line of a file, empty if it cannot be read
+static std::string read_line(const std::string& file_name) {
+  std::ifstream file(file_name);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+// "0-3,8-11" as sysfs writes CPU and node lists
+static std::vector<int> parse_list(const std::string& list) {
+  std::vector<int> numbers;
+  std::istringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    int first, last;
+    int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (count < 1) continue;
+    if (count == 1) last = first;
+    for (int n = first; n <= last; n++) numbers.push_back(n);
+  }
+  return numbers;
+}
+
+// cgroup v2: "max 100000" or "200000 100000"
+static double cpu_max(const std::string& dir) {
+  std::istringstream fields(read_line(dir + "/cpu.max"));
+  std::string quota;
+  double period = 0;
+  if (!(fields >> quota >> period) || quota == "max" || period <= 0) return 0;
+  return atof(quota.c_str()) / period;
+}
+
+// cgroup v1: a quota of -1 is unlimited
+static double cfs_quota(const std::string& dir) {
+  double quota = atof(read_line(dir + "/cpu.cfs_quota_us").c_str());
+  double period = atof(read_line(dir + "/cpu.cfs_period_us").c_str());
+  return quota > 0 && period > 0 ? quota / period : 0;
+}
+
+// The tightest quota of the cgroup at path under root and of its parents.
+// Inside a container the path may not exist under root, whose own limit is
+// then found at the end.
+static double cgroup_quota(const std::string& root, std::string path,
+                           bool v2) {
+  double quota = 0;
+  for (;;) {
+    double q = v2 ? cpu_max(root + path) : cfs_quota(root + path);
+    if (q > 0 && (!quota || q < quota)) quota = q;
+    if (path.empty()) return quota;
+    path.resize(path.find_last_of('/'));
+  }
+}
+
+// quota of every hierarchy this process is in that limits the CPU
+static double cgroup_cpu_quota() {
+  std::ifstream file("/proc/self/cgroup");
+  std::string line;
+  double quota = 0;
+  while (std::getline(file, line)) {
+    // hierarchy:controllers:path, where v2 has no controllers
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) continue;
+    std::string controllers = "," + line.substr(first + 1, second - first - 1);
+    std::string path = line.substr(second + 1);
+    double q = 0;
+    if (controllers == ",") {
+      // hybrid systems mount v2 next to the v1 controllers
+      q = cgroup_quota("/sys/fs/cgroup", path, true);
+      if (!q) q = cgroup_quota("/sys/fs/cgroup/unified", path, true);
+    } else if ((controllers + ",").find(",cpu,") != std::string::npos) {
+      q = cgroup_quota("/sys/fs/cgroup/cpu", path, false);
+      if (!q) q = cgroup_quota("/sys/fs/cgroup/cpu,cpuacct", path, false);
+    }
+    if (q > 0 && (!quota || q < quota)) quota = q;
+  }
+  return quota;
+}
+#endif
+
+// CPUs in the affinity mask in ascending order, empty where unknown
+static std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+  }
+#endif
+  return cpus;
+}
+
+CpuLimits cpu_limits() {
+  CpuLimits limits;
+  limits.online = std::thread::hardware_concurrency();
+  limits.allowed = int(allowed_cpus().size());
+#ifdef __linux__
+  limits.quota = cgroup_cpu_quota();
+#endif
+  return limits;
+}
+
+int cpu_count() {
+  std::string reason;
+  return cpu_count(cpu_limits(), &reason);
+}
+
+int cpu_count(const CpuLimits& limits, std::string* reason) {
+  int n = limits.allowed ? limits.allowed : limits.online;
+  char text[128];
+  if (limits.quota > 0 && limits.quota < n) {
+    // threads beyond the quota only get throttled
+    snprintf(text, sizeof(text), "cgroup quota of %.2f CPUs", limits.quota);
+    *reason = text;
+    return std::max(1, int(std::ceil(limits.quota)));
+  }
+
+  if (limits.allowed && limits.allowed < limits.online) {
+    snprintf(text, sizeof(text), "%d of %d CPUs allowed", limits.allowed,
+             limits.online);
+  } else {
+    snprintf(text, sizeof(text), "%d CPU%s", n, n == 1 ? "" : "s");
+  }
+  *reason = text;
+  switch (n) {
+    case 0:
+      return 2;
+    case 1:
+      return 3;
+    default:
+      return n + 2;
+  }
+}
+
+bool parse_pin_mode(const std::string& name, PinMode* mode) {
+  if (name == "none") {
+    *mode = PinMode::none;
+  } else if (name == "cores") {
+    *mode = PinMode::cores;
+  } else if (name == "node") {
+    *mode = PinMode::node;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::vector<int> pin_plan(PinMode mode, std::string* description) {
+  std::vector<int> plan;
+#ifdef __linux__
+  std::vector<int> allowed = allowed_cpus();
+  char text[128] = "";
+  if (mode == PinMode::cores) {
+    // the first allowed CPU of every core, leaving out its siblings
+    std::set<std::pair<int, int>> cores;
+    for (int cpu : allowed) {
+      std::string topology = "/sys/devices/system/cpu/cpu" +
+                             std::to_string(cpu) + "/topology/";
+      std::string core = read_line(topology + "core_id");
+      std::string package = read_line(topology + "physical_package_id");
+      if (core.empty()) return {};
+      if (cores.emplace(atoi(package.c_str()), atoi(core.c_str())).second) {
+        plan.push_back(cpu);
+      }
+    }
+    snprintf(text, sizeof(text), "one CPU on each of %zu physical cores",
+             plan.size());
+  } else if (mode == PinMode::node) {
+    int best = -1;
+    std::string nodes = "/sys/devices/system/node/";
+    for (int node : parse_list(read_line(nodes + "possible"))) {
+      std::vector<int> usable;
+      std::string cpus = nodes + "node" + std::to_string(node) + "/cpulist";
+      for (int cpu : parse_list(read_line(cpus))) {
+        if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+          usable.push_back(cpu);
+        }
+      }
+      if (usable.size() > plan.size()) {
+        plan = usable;
+        best = node;
+      }
+    }
+    snprintf(text, sizeof(text), "the %zu allowed CPUs of NUMA node %d",
+             plan.size(), best);
+  }
+  *description = text;
+#endif
+  return plan;
+}
+
+bool pin_thread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// CPUs this process may run on
+struct CpuLimits {
+  // logical CPUs of the machine
+  int online = 0;
+  // CPUs in the affinity mask, 0 where the platform does not tell
+  int allowed = 0;
+  // CPU time the cgroup grants, in CPUs; 0 without a quota
+  double quota = 0;
+};
+
+// reads the affinity mask and the cgroup v2 cpu.max or v1 CFS quota
+CpuLimits cpu_limits();
+
+// Number of worker threads to use when the user did not ask for a count.
+int cpu_count();
+// same for limits; reason tells how the count came about, for logging
+int cpu_count(const CpuLimits& limits, std::string* reason);
+
+// where workers are bound: nowhere, one per physical core or all on the
+// NUMA node with the most allowed CPUs
+enum class PinMode { none, cores, node };
+
+bool parse_pin_mode(const std::string& name, PinMode* mode);
+
+// CPUs for the workers, worker i taking the one at i modulo the size, and a
+// description for logging. Empty for PinMode::none and where the topology
+// cannot be read.
+std::vector<int> pin_plan(PinMode mode, std::string* description);
+
+// binds the calling thread to cpu; false where that is not possible
+bool pin_thread(int cpu);
@@ -21,12 +21,12 @@
  */
 
 #include <cstdint>
-#include <cstdlib>
 #include <cstring>
-#include <vector>
 
-#define ROL(i, b) (((i) << (b)) | ((i) >> (32 - (b))))
-#define BYTES2LONG(b) ((b)[0] << 24 | (b)[1] << 16 | (b)[2] << 8 | (b)[3])
+#include "crc.h"
+#include "util.h"
+
+#define ROL(i, b) (((i) << (b)) | ((i) >> ((32 - (b)) & 31)))
 
 #define N64_HEADER_SIZE 0x40
 #define N64_BC_SIZE (0x1000 - N64_HEADER_SIZE)
@@ -41,37 +41,62 @@
 #define CHECKSUM_CIC6105 0xDF26F436
 #define CHECKSUM_CIC6106 0x1FEA617A
 
-unsigned int crc_table[256];
+namespace {
 
-void gen_table() {
-  unsigned int crc, poly;
-  int i, j;
+// table[0] is the classic byte table; table[k][i] is the CRC of byte i
+// followed by k zero bytes, so eight bytes can be folded in at once
+struct CrcTables {
+  uint32_t table[8][256];
 
-  poly = 0xEDB88320;
-  for (i = 0; i < 256; i++) {
-    crc = i;
-    for (j = 8; j > 0; j--) {
-      if (crc & 1)
-        crc = (crc >> 1) ^ poly;
-      else
-        crc >>= 1;
+  constexpr CrcTables() : table() {
+    const uint32_t poly = 0xEDB88320;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int k = 1; k < 8; k++) {
+        uint32_t prev = table[k - 1][i];
+        table[k][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+      }
     }
-    crc_table[i] = crc;
   }
+};
+
+constexpr CrcTables crc_tables;
+
+inline uint32_t load_be32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return bigendian(v);
 }
 
-unsigned int crc32(unsigned char *data, int len) {
-  unsigned int crc = ~0;
-  int i;
+inline uint32_t load_le32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  if constexpr (!Endian::little) v = byteSwap(v);
+  return v;
+}
 
-  for (i = 0; i < len; i++) {
-    crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xFF];
+// slicing-by-8
+uint32_t crc32(const uint8_t* data, size_t len) {
+  const auto& t = crc_tables.table;
+  uint32_t crc = ~0u;
+
+  for (; len >= 8; data += 8, len -= 8) {
+    uint32_t lo = load_le32(data) ^ crc;
+    uint32_t hi = load_le32(data + 4);
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+          t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
   }
+  for (; len; data++, len--) crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
 
   return ~crc;
 }
 
-int N64GetCIC(unsigned char *data) {
+int N64GetCIC(const uint8_t* data) {
   switch (crc32(&data[N64_HEADER_SIZE], N64_BC_SIZE)) {
     case 0x6170A4A1:
       return 6101;
@@ -88,13 +113,43 @@ int N64GetCIC(unsigned char *data) {
   return 0;
 }
 
-int N64CalcCRC(unsigned int *crc, unsigned char *data) {
-  int bootcode, i;
-  unsigned int seed;
+struct CrcState {
+  uint32_t t1, t2, t3, t4, t5, t6;
+};
+
+// The six sums depend on each other from word to word, so the loop cannot be
+// vectorized; what it needs is single-load big-endian words and no CIC check
+// per word. The 6105 variant mixes in the boot code instead of t5.
+template <bool cic6105>
+void N64ChecksumLoop(CrcState& s, const uint8_t* data) {
+  uint32_t t1 = s.t1, t2 = s.t2, t3 = s.t3, t4 = s.t4, t5 = s.t5, t6 = s.t6;
+  const uint8_t* boot = data + N64_HEADER_SIZE + 0x0710;
+
+  for (uint32_t i = CHECKSUM_START; i < CHECKSUM_START + CHECKSUM_LENGTH;
+       i += 4) {
+    uint32_t d = load_be32(&data[i]);
+    if ((t6 + d) < t6) t4++;
+    t6 += d;
+    t3 ^= d;
+    uint32_t r = ROL(d, (d & 0x1F));
+    t5 += r;
+    if (t2 > d)
+      t2 ^= r;
+    else
+      t2 ^= t6 ^ d;
 
-  unsigned int t1, t2, t3;
-  unsigned int t4, t5, t6;
-  unsigned int r, d;
+    if (cic6105)
+      t1 += load_be32(&boot[i & 0xFF]) ^ d;
+    else
+      t1 += t5 ^ d;
+  }
+
+  s = {t1, t2, t3, t4, t5, t6};
+}
+
+int N64CalcCRC(uint32_t* crc, const uint8_t* data) {
+  int bootcode;
+  uint32_t seed;
 
   switch ((bootcode = N64GetCIC(data))) {
     case 6101:
@@ -114,69 +169,46 @@ int N64CalcCRC(unsigned int *crc, unsigned char *data) {
       return 1;
   }
 
-  t1 = t2 = t3 = t4 = t5 = t6 = seed;
-
-  i = CHECKSUM_START;
-  while (i < (CHECKSUM_START + CHECKSUM_LENGTH)) {
-    d = BYTES2LONG(&data[i]);
-    if ((t6 + d) < t6) t4++;
-    t6 += d;
-    t3 ^= d;
-    r = ROL(d, (d & 0x1F));
-    t5 += r;
-    if (t2 > d)
-      t2 ^= r;
-    else
-      t2 ^= t6 ^ d;
-
-    if (bootcode == 6105)
-      t1 += BYTES2LONG(&data[N64_HEADER_SIZE + 0x0710 + (i & 0xFF)]) ^ d;
-    else
-      t1 += t5 ^ d;
-
-    i += 4;
+  CrcState s = {seed, seed, seed, seed, seed, seed};
+  if (bootcode == 6105) {
+    N64ChecksumLoop<true>(s, data);
+  } else {
+    N64ChecksumLoop<false>(s, data);
   }
+
   if (bootcode == 6103) {
-    crc[0] = (t6 ^ t4) + t3;
-    crc[1] = (t5 ^ t2) + t1;
+    crc[0] = (s.t6 ^ s.t4) + s.t3;
+    crc[1] = (s.t5 ^ s.t2) + s.t1;
   } else if (bootcode == 6106) {
-    crc[0] = (t6 * t4) + t3;
-    crc[1] = (t5 * t2) + t1;
+    crc[0] = (s.t6 * s.t4) + s.t3;
+    crc[1] = (s.t5 * s.t2) + s.t1;
   } else {
-    crc[0] = t6 ^ t4 ^ t3;
-    crc[1] = t5 ^ t2 ^ t1;
+    crc[0] = s.t6 ^ s.t4 ^ s.t3;
+    crc[1] = s.t5 ^ s.t2 ^ s.t1;
   }
 
   return 0;
 }
 
-void fix_crc(std::vector<uint8_t> &data) {
-  unsigned char CRC1[4];
-  unsigned char CRC2[4];
-  unsigned int crc[2];
-  std::vector<uint8_t> buffer(CHECKSUM_START + CHECKSUM_LENGTH);
-  gen_table();
-
-  memcpy(buffer.data(), data.data(), CHECKSUM_START + CHECKSUM_LENGTH);
-
-  if (!N64CalcCRC(crc, buffer.data())) {
-    unsigned int kk1 = crc[0];
-    unsigned int kk2 = crc[1];
-    for (int i = 0; i < 4; i++) {
-      CRC1[i] = (kk1 >> (24 - 8 * i)) & 0xFF;
-      CRC2[i] = (kk2 >> (24 - 8 * i)) & 0xFF;
-    }
+}  // namespace
 
-    if (crc[0] != BYTES2LONG(&buffer[N64_CRC1])) {
-      for (int i = 0; i < 4; i++) {
-        data[N64_CRC1 + i] = CRC1[i];
-      }
-    }
+bool calc_crc(const uint8_t* data, size_t size, uint32_t crc[2]) {
+  if (size < CHECKSUM_START + CHECKSUM_LENGTH) return false;
+  return !N64CalcCRC(crc, data);
+}
 
-    if (crc[1] != BYTES2LONG(&buffer[N64_CRC2])) {
-      for (int i = 0; i < 4; i++) {
-        data[N64_CRC2 + i] = CRC2[i];
-      }
-    }
-  }
+bool verify_crc(const uint8_t* data, size_t size) {
+  uint32_t crc[2];
+  return calc_crc(data, size, crc) && crc[0] == load_be32(&data[N64_CRC1]) &&
+         crc[1] == load_be32(&data[N64_CRC2]);
+}
+
+void fix_crc(uint8_t* data, size_t size) {
+  uint32_t crc[2];
+  if (!calc_crc(data, size, crc)) return;
+
+  uint32_t crc1 = bigendian(crc[0]);
+  uint32_t crc2 = bigendian(crc[1]);
+  memcpy(&data[N64_CRC1], &crc1, 4);
+  memcpy(&data[N64_CRC2], &crc2, 4);
 }
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Checksums of a big-endian N64 ROM image. All of them work in place and never
+// allocate. Images shorter than the checksummed area or with an unknown CIC
+// boot code have no valid checksum.
+
+// Computes the two header checksum words; false if there are none.
+bool calc_crc(const uint8_t* data, size_t size, uint32_t crc[2]);
+// True if the header holds the checksum of the image.
+bool verify_crc(const uint8_t* data, size_t size);
+// Recomputes the header checksum in place; other images are left untouched.
+void fix_crc(uint8_t* data, size_t size);
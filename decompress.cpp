@@ -0,0 +1,97 @@
+#include "decompress.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "codec.h"
+
+bool decompress_rom(N64ROM& rom, ThreadPool& pool) {
+  std::vector<uint8_t> compression_index(rom.entry_count());
+
+  const size_t first_file = 3;
+  uint32_t last_endv = 0;
+
+  // Every entry lands in its own startV range, so they can all be
+  // decoded at the same time, largest first
+  std::vector<size_t> order;
+  for (size_t i = first_file; i < rom.entry_count(); ++i) {
+    auto entry = rom.inEntry(i);
+    auto& outentry = rom.outEntry(i);
+
+    // Dummy entry, skip it!
+    if (!entry.endV) continue;
+
+    order.push_back(i);
+    if (entry.is_compressed()) compression_index[i] = 1;
+
+    last_endv = entry.endV;
+    outentry.startP = entry.startV;
+    outentry.endP = 0;
+  }
+
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return rom.inEntry(a).size() > rom.inEntry(b).size();
+  });
+
+  // The table comes from the input file, so check every range before use
+  for (size_t i : order) {
+    const auto& entry = rom.inEntry(i);
+    size_t in_end = entry.is_compressed() ? entry.endP
+                                          : size_t(entry.startP) + entry.size();
+    if (entry.endV < entry.startV || entry.endV > rom.out().size() ||
+        in_end < entry.startP || in_end > rom.in().size()) {
+      fprintf(stderr, "Error: table entry %zu is out of bounds\n", i);
+      return false;
+    }
+  }
+  if (last_endv + compression_index.size() > rom.out().size()) {
+    fprintf(stderr, "Error: no room for the compression index\n");
+    return false;
+  }
+
+  // decoding leaves the codecs untouched, so the workers share them; every
+  // file may be in any format
+  std::unique_ptr<Codec> codecs[] = {Codec::create(Format::yaz0),
+                                     Codec::create(Format::yay0),
+                                     Codec::create(Format::mio0)};
+  std::atomic<size_t> corrupt(0);
+  JobGroup group(pool);
+  for (size_t i : order) {
+    group.submit(rom.inEntry(i).size(), [&rom, &codecs, &corrupt, i] {
+      const auto& entry = rom.inEntry(i);
+      if (entry.is_compressed()) {
+        const uint8_t* src = rom.in().data() + entry.startP;
+        size_t src_size = entry.endP - entry.startP;
+        Format format;
+        size_t size;
+        if (!detect_format(src, src_size, &format) ||
+            !codecs[int(format)]->decoded_size(src, src_size, &size) ||
+            size != entry.size() ||
+            !codecs[int(format)]->decode(
+                src, src_size, rom.out().data() + entry.startV, size)) {
+          fprintf(stderr, "Error: entry %zu is not valid compressed data\n",
+                  i);
+          corrupt++;
+        }
+      } else {
+        memcpy(rom.out().data() + entry.startV,
+               rom.in().data() + entry.startP, entry.size());
+      }
+    });
+  }
+  group.wait();
+  if (corrupt) return false;
+
+  // Write the list of compressed entries at the back of the decompressed file
+  // for later recompression
+  auto& compression_index_entry = rom.outEntry(rom.entry_count() - 1);
+  compression_index_entry.startP = last_endv;
+  memcpy(rom.out().data() + last_endv, compression_index.data(),
+         compression_index.size());
+  return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "ThreadPool.h"
+#include "rom.h"
+
+// Decodes every file of rom into rom.out() on pool and appends the list of
+// compressed entries for later recompression. The caller writes the table
+// and the checksum. Returns false, after printing why, if the table or any
+// file is corrupt.
+bool decompress_rom(N64ROM& rom, ThreadPool& pool);
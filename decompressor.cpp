@@ -1,76 +1,71 @@
-#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include <string>
 #include <vector>
 
-#include "findtable.h"
+#include "ThreadPool.h"
+#include "cpu.h"
+#include "decompress.h"
 #include "rom.h"
-#include "util.h"
-#include "yaz0.h"
 
 #define UINTSIZE 0x01000000
 #define COMPSIZE 0x02000000
 #define DCMPSIZE 0x04000000
 
-void decompress(const std::string& name, const std::string& outname);
+void decompress(const std::string& name, const std::string& outname,
+                int threads, bool huge_pages, bool keep_byte_order);
+
+void usage(const char* argv0) {
+  fprintf(stderr,
+          "Usage: %s [options] file [outfile]\n"
+          "  --threads N   number of worker threads\n"
+          "  --huge-pages  back the output image with huge pages\n"
+          "  --keep-byte-order  write the output in the byte order of the "
+          "input (.v64, .n64) instead of .z64\n",
+          argv0);
+}
 
 int main(int argc, char** argv) {
-  if (argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: %s file [outfile]", argv[0]);
+  int threads = cpu_count();
+  bool huge_pages = false;
+  bool keep_byte_order = false;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--threads" && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (arg == "--huge-pages") {
+      huge_pages = true;
+    } else if (arg == "--keep-byte-order") {
+      keep_byte_order = true;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  if ((files.size() != 1 && files.size() != 2) || threads < 1) {
+    usage(argv[0]);
     return 1;
   }
 
-  std::string name = argv[1];
+  std::string name = files[0];
   std::string outname =
-      argc == 3 ? argv[2]
-                : (name.substr(0, name.find_last_of('.')) + "-decomp.z64");
+      files.size() == 2
+          ? files[1]
+          : (name.substr(0, name.find_last_of('.')) + "-decomp.z64");
 
-  decompress(name, outname);
+  decompress(name, outname, threads, huge_pages, keep_byte_order);
 
   return 0;
 }
 
-void decompress(const std::string& name, const std::string& outname) {
-  N64ROM rom(name);
-
-  std::vector<uint8_t> compression_index(rom.entry_count());
-
-  const size_t first_file = 3;
-  uint32_t last_endv;
-
-  // Set everything from the first file we copy to the end to 0
-  memset(rom.out().data() + rom.inEntry(first_file).startP, 0,
-         DCMPSIZE - rom.inEntry(first_file).startP);
-
-  for (size_t i = first_file; i < rom.entry_count(); ++i) {
-    auto entry = rom.inEntry(i);
-    auto& outentry = rom.outEntry(i);
-    auto& outpreventry = rom.outEntry(i - 1);
-
-    // Dummy entry, skip it!
-    if (!entry.endV) continue;
-
-    if (entry.is_compressed()) {
-      yaz0_decode(rom.in().data() + entry.startP,
-                  rom.out().data() + entry.startV, entry.size());
-      compression_index[i] = 1;
-    } else {
-      memcpy(rom.out().data() + entry.startV, rom.in().data() + entry.startP,
-             entry.size());
-    }
-
-    last_endv = entry.endV;
-    outentry.startP = entry.startV;
-    outentry.endP = 0;
-  }
-
-  // Write the list of compressed entries at the back of the decompressed file
-  // for later recompression
-  auto& compression_index_entry = rom.outEntry(rom.entry_count() - 1);
-  compression_index_entry.startP = last_endv;
-  memcpy(rom.out().data() + last_endv, compression_index.data(),
-         compression_index.size());
-
-  rom.save(outname);
+void decompress(const std::string& name, const std::string& outname,
+                int threads, bool huge_pages, bool keep_byte_order) {
+  N64ROM rom(name, huge_pages);
+  ThreadPool pool(threads);
+  if (!decompress_rom(rom, pool)) exit(1);
+  rom.save(outname, keep_byte_order ? rom.byte_order() : ByteOrder::big);
 }
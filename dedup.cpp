@@ -0,0 +1,66 @@
+#include "dedup.h"
+
+DedupTable::DedupTable(uint64_t max_bytes) : max_bytes(max_bytes) {}
+
+bool DedupTable::claim(const std::string& key, Waiter waiter) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    entries.emplace(key, Entry());
+    return true;
+  }
+
+  shared_count++;
+  Entry& entry = it->second;
+  if (!entry.data) {
+    entry.waiters.push_back(std::move(waiter));
+    return false;
+  }
+  lru.splice(lru.begin(), lru, entry.used);
+  // the entry may be dropped as soon as the lock is released
+  Data data = entry.data;
+  lock.unlock();
+  waiter(data.get());
+  return false;
+}
+
+void DedupTable::publish(const std::string& key, const uint8_t* data,
+                         size_t size) {
+  Data published = std::make_shared<const std::vector<uint8_t>>(data,
+                                                                data + size);
+  std::vector<Waiter> waiters;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    Entry& entry = entries[key];
+    entry.data = published;
+    waiters.swap(entry.waiters);
+    lru.push_front(key);
+    entry.used = lru.begin();
+    total += size;
+    // entries still being encoded are not in lru, so they always stay
+    while (total > max_bytes && !lru.empty()) {
+      auto last = entries.find(lru.back());
+      total -= last->second.data->size();
+      entries.erase(last);
+      lru.pop_back();
+    }
+  }
+  for (auto& waiter : waiters) waiter(published.get());
+}
+
+void DedupTable::abandon(const std::string& key) {
+  std::vector<Waiter> waiters;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) return;
+    waiters.swap(it->second.waiters);
+    entries.erase(it);
+  }
+  for (auto& waiter : waiters) waiter(nullptr);
+}
+
+size_t DedupTable::shared() const {
+  std::unique_lock<std::mutex> lock(mutex);
+  return shared_count;
+}
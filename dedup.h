@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compressed files shared between the ROMs of one batch, keyed by the same
+// content hash as CompressionCache. The first ROM to claim a key encodes the
+// file and publishes it; every later claim gets the result through a callback,
+// right away or once it is published, so no worker ever waits for another.
+//
+// Published files are kept for later claims, dropping the least recently
+// claimed past max_bytes. A key that was dropped is encoded again by the next
+// ROM that claims it. Callbacks have to copy the data they are given.
+class DedupTable {
+ public:
+  // data is null if the owner gave up on the file
+  typedef std::function<void(const std::vector<uint8_t>* data)> Waiter;
+
+  explicit DedupTable(uint64_t max_bytes = 256ull << 20);
+
+  // true if the caller now owns key and has to publish it
+  bool claim(const std::string& key, Waiter waiter);
+  void publish(const std::string& key, const uint8_t* data, size_t size);
+  // for an owner whose result is unusable: the waiters get null and the next
+  // claim owns key again
+  void abandon(const std::string& key);
+
+  // claims that were answered by another ROM
+  size_t shared() const;
+
+ private:
+  typedef std::shared_ptr<const std::vector<uint8_t>> Data;
+
+  struct Entry {
+    // null until published
+    Data data;
+    std::vector<Waiter> waiters;
+    // position in lru once published
+    std::list<std::string>::iterator used;
+  };
+
+  uint64_t max_bytes;
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+  // keys of published entries, most recently claimed first
+  std::list<std::string> lru;
+  uint64_t total = 0;
+  size_t shared_count = 0;
+};
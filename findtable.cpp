@@ -1,36 +1,73 @@
-#include <stdint.h>
-#include <stdio.h>
-#include <algorithm>
-#include <vector>
+#include "findtable.h"
 
-#include "util.h"
+#include <string.h>
 
-#define UINTSIZE 0x1000000
-#define COMPSIZE 0x2000000
+#include "readwrite.h"
 
-uint32_t findTable(const std::vector<uint8_t>& inROM) {
-  std::vector<uint8_t> marker{0x7A, 0x65, 0x6C, 0x64, 0x61,
-                              0x40, 0x73, 0x72, 0x64};
-  auto it =
-      std::search(inROM.begin(), inROM.end(), marker.begin(), marker.end());
+// the build string ends right before the table, whose second word is the end
+// of the first file
+static const char build_marker[] = "zelda@srd";
+#define MARKER_SIZE (sizeof(build_marker) - 1)
+#define MARKER_RANGE 0x40
+#define FIRST_FILE_END 0x1060
 
-  if (it == inROM.end()) {
-    fprintf(stderr, "Error: Couldn't find file table\n");
-    exit(1);
+// table offsets of the known OoT and Master Quest revisions
+static const uint32_t known_tables[] = {
+    0x7430,   // NTSC 1.0 and 1.1
+    0x7960,   // NTSC 1.2
+    0x7950,   // PAL 1.0 and 1.1
+    0x7170,   // GameCube, all regions, and Master Quest
+    0x12F70,  // debug and Master Quest debug
+};
+
+// memchr for the rarest byte of needle, at index key, then compare the rest
+static const uint8_t* find_bytes(const uint8_t* begin, const uint8_t* end,
+                                 const void* needle, size_t size, size_t key) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(needle);
+  if (size_t(end - begin) < size) return nullptr;
+
+  const uint8_t* p = begin + key;
+  const uint8_t* last = end - size + key;
+  while (p <= last) {
+    p = static_cast<const uint8_t*>(memchr(p, bytes[key], last - p + 1));
+    if (!p) return nullptr;
+    if (!memcmp(p - key, bytes, size)) return p - key;
+    p++;
   }
+  return nullptr;
+}
 
-  it += 32;
+static bool is_table(const uint8_t* rom, size_t size, size_t position) {
+  if (position < MARKER_RANGE || position + 8 > size) return false;
+  if (U32(rom + position) != 0 || U32(rom + position + 4) != FIRST_FILE_END) {
+    return false;
+  }
+  return find_bytes(rom + position - MARKER_RANGE, rom + position,
+                    build_marker, MARKER_SIZE, 0) != nullptr;
+}
 
-  std::vector<uint8_t> marker2{0x00, 0x00, 0x10, 0x60};
-  std::vector<uint8_t>::const_iterator final_position;
-  do {
-    final_position =
-        std::search(it, inROM.end(), marker2.begin(), marker2.end());
-    if (final_position != inROM.end()) {
-      break;
-    }
-    it += 16;
-  } while (final_position < inROM.end());
+bool scanTable(const uint8_t* rom, size_t size, size_t* position) {
+  const uint8_t* end = rom + size;
+  const uint8_t* marker =
+      find_bytes(rom, end, build_marker, MARKER_SIZE, 0);
+  if (!marker) return false;
 
-  return static_cast<uint32_t>(final_position - inROM.begin() - 4);
+  // 00 00 10 60 is the end of the first file, four bytes into the table
+  static const uint8_t first_file_end[] = {0x00, 0x00, 0x10, 0x60};
+  const uint8_t* found = find_bytes(marker + 32, end, first_file_end,
+                                    sizeof(first_file_end), 3);
+  if (!found || found - rom < 4) return false;
+
+  *position = found - rom - 4;
+  return true;
+}
+
+bool findTable(const uint8_t* rom, size_t size, size_t* position) {
+  for (uint32_t known : known_tables) {
+    if (is_table(rom, size, known)) {
+      *position = known;
+      return true;
+    }
+  }
+  return scanTable(rom, size, position);
 }
@@ -1,3 +1,12 @@
 #pragma once
 
-uint32_t findTable(const std::vector<uint8_t>& inROM);
+#include <cstddef>
+#include <cstdint>
+
+// Locates the file table (dmadata) of a big-endian OoT ROM image and stores
+// its offset in position. Offsets of the known revisions are checked first;
+// any other image is scanned. Returns false if there is no table.
+bool findTable(const uint8_t* rom, size_t size, size_t* position);
+// Same, but always scans for the "zelda@srd" build string that precedes the
+// table.
+bool scanTable(const uint8_t* rom, size_t size, size_t* position);
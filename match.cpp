@@ -0,0 +1,296 @@
+#include "match.h"
+
+#include <string.h>
+#include <initializer_list>
+
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define MATCH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define MATCH_TARGET(x)
+#else
+#define MATCH_TARGET(x) __attribute__((target(x)))
+#endif
+
+typedef uint32_t (*match_length_fn)(const uint8_t*, const uint8_t*, uint32_t);
+typedef size_t (*find_candidates_fn)(const uint8_t*, size_t, const uint8_t*,
+                                     uint32_t*);
+
+namespace {
+
+inline uint32_t count_trailing_zeros(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return index;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+inline uint32_t count_leading_zeros(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse64(&index, x);
+  return 63 - index;
+#else
+  return __builtin_clzll(x);
+#endif
+}
+
+// index of the first differing byte in two words loaded from memory
+inline uint32_t first_difference(uint64_t diff) {
+  if constexpr (Endian::little) {
+    return count_trailing_zeros(diff) / 8;
+  }
+  return count_leading_zeros(diff) / 8;
+}
+
+uint32_t match_length_scalar(const uint8_t* a, const uint8_t* b,
+                             uint32_t max_len) {
+  uint32_t len = 0;
+  while (len + 8 <= max_len) {
+    uint64_t x, y;
+    memcpy(&x, a + len, 8);
+    memcpy(&y, b + len, 8);
+    if (x != y) return len + first_difference(x ^ y);
+    len += 8;
+  }
+  while (len < max_len && a[len] == b[len]) len++;
+  return len;
+}
+
+// the vector kernels finish their tail here, starting at window position i
+// with n candidates already written
+size_t find_candidates_from(const uint8_t* window, size_t i, size_t count,
+                            const uint8_t* key, uint32_t* out, size_t n) {
+  for (; i < count; i++) {
+    if (window[i] == key[0] && window[i + 1] == key[1] &&
+        window[i + 2] == key[2]) {
+      out[n++] = static_cast<uint32_t>(i);
+    }
+  }
+  return n;
+}
+
+size_t find_candidates_scalar(const uint8_t* window, size_t count,
+                              const uint8_t* key, uint32_t* out) {
+  return find_candidates_from(window, 0, count, key, out, 0);
+}
+
+#ifdef MATCH_X86
+
+MATCH_TARGET("sse2")
+uint32_t match_length_sse2(const uint8_t* a, const uint8_t* b,
+                           uint32_t max_len) {
+  uint32_t len = 0;
+  while (len + 16 <= max_len) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + len));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + len));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (mask) return len + count_trailing_zeros(mask);
+    len += 16;
+  }
+  return len + match_length_scalar(a + len, b + len, max_len - len);
+}
+
+MATCH_TARGET("sse4.2")
+uint32_t match_length_sse42(const uint8_t* a, const uint8_t* b,
+                            uint32_t max_len) {
+  uint32_t len = 0;
+  while (len + 16 <= max_len) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + len));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + len));
+    int index = _mm_cmpestri(x, 16, y, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_EACH |
+                                 _SIDD_NEGATIVE_POLARITY |
+                                 _SIDD_LEAST_SIGNIFICANT);
+    if (index < 16) return len + index;
+    len += 16;
+  }
+  return len + match_length_scalar(a + len, b + len, max_len - len);
+}
+
+MATCH_TARGET("avx2")
+uint32_t match_length_avx2(const uint8_t* a, const uint8_t* b,
+                           uint32_t max_len) {
+  uint32_t len = 0;
+  while (len + 32 <= max_len) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + len));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + len));
+    uint32_t mask = ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    if (mask) return len + count_trailing_zeros(mask);
+    len += 32;
+  }
+  return len + match_length_sse2(a + len, b + len, max_len - len);
+}
+
+MATCH_TARGET("sse2")
+size_t find_candidates_sse2_from(const uint8_t* window, size_t i, size_t count,
+                                 const uint8_t* key, uint32_t* out, size_t n) {
+  const __m128i k0 = _mm_set1_epi8(static_cast<char>(key[0]));
+  const __m128i k1 = _mm_set1_epi8(static_cast<char>(key[1]));
+  const __m128i k2 = _mm_set1_epi8(static_cast<char>(key[2]));
+  for (; i + 16 <= count; i += 16) {
+    const uint8_t* p = window + i;
+    __m128i m = _mm_and_si128(
+        _mm_and_si128(
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), k0),
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1)), k1)),
+        _mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2)), k2));
+    uint32_t bits = _mm_movemask_epi8(m);
+    while (bits) {
+      out[n++] = static_cast<uint32_t>(i + count_trailing_zeros(bits));
+      bits &= bits - 1;
+    }
+  }
+  return find_candidates_from(window, i, count, key, out, n);
+}
+
+size_t find_candidates_sse2(const uint8_t* window, size_t count,
+                            const uint8_t* key, uint32_t* out) {
+  return find_candidates_sse2_from(window, 0, count, key, out, 0);
+}
+
+MATCH_TARGET("avx2")
+size_t find_candidates_avx2(const uint8_t* window, size_t count,
+                            const uint8_t* key, uint32_t* out) {
+  const __m256i k0 = _mm256_set1_epi8(static_cast<char>(key[0]));
+  const __m256i k1 = _mm256_set1_epi8(static_cast<char>(key[1]));
+  const __m256i k2 = _mm256_set1_epi8(static_cast<char>(key[2]));
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const uint8_t* p = window + i;
+    __m256i m = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), k0),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1)),
+                k1)),
+        _mm256_cmpeq_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2)), k2));
+    uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(m));
+    while (bits) {
+      out[n++] = static_cast<uint32_t>(i + count_trailing_zeros(bits));
+      bits &= bits - 1;
+    }
+  }
+  return find_candidates_sse2_from(window, i, count, key, out, n);
+}
+
+#endif
+
+
+struct Kernels {
+  SimdLevel level;
+  match_length_fn match_length;
+  find_candidates_fn find_candidates;
+};
+
+bool cpu_supports(SimdLevel level) {
+#ifdef MATCH_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  int max_leaf = info[0];
+  __cpuid(info, 1);
+  bool sse2 = (info[3] >> 26) & 1;
+  bool sse42 = (info[2] >> 20) & 1;
+  bool osxsave = (info[2] >> 27) & 1;
+  bool avx2 = false;
+  if (max_leaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] >> 5) & 1;
+  }
+#else
+  bool sse2 = __builtin_cpu_supports("sse2");
+  bool sse42 = __builtin_cpu_supports("sse4.2");
+  bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+  switch (level) {
+    case SimdLevel::scalar:
+      return true;
+    case SimdLevel::sse2:
+      return sse2;
+    case SimdLevel::sse42:
+      return sse42;
+    case SimdLevel::avx2:
+      return avx2;
+  }
+  return false;
+#else
+  return level == SimdLevel::scalar;
+#endif
+}
+
+Kernels kernels_for(SimdLevel level) {
+  switch (level) {
+#ifdef MATCH_X86
+    case SimdLevel::avx2:
+      return {level, match_length_avx2, find_candidates_avx2};
+    case SimdLevel::sse42:
+      return {level, match_length_sse42, find_candidates_sse2};
+    case SimdLevel::sse2:
+      return {level, match_length_sse2, find_candidates_sse2};
+#endif
+    default:
+      return {SimdLevel::scalar, match_length_scalar, find_candidates_scalar};
+  }
+}
+
+Kernels detect_kernels() {
+  for (SimdLevel level :
+       {SimdLevel::avx2, SimdLevel::sse42, SimdLevel::sse2}) {
+    if (cpu_supports(level)) return kernels_for(level);
+  }
+  return kernels_for(SimdLevel::scalar);
+}
+
+Kernels kernels = detect_kernels();
+
+}  // namespace
+
+uint32_t match_length(const uint8_t* a, const uint8_t* b, uint32_t max_len) {
+  return kernels.match_length(a, b, max_len);
+}
+
+size_t find_candidates(const uint8_t* window, size_t count, const uint8_t* key,
+                       uint32_t* out) {
+  return kernels.find_candidates(window, count, key, out);
+}
+
+SimdLevel simd_level() { return kernels.level; }
+
+const char* simd_level_name(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::scalar:
+      return "scalar";
+    case SimdLevel::sse2:
+      return "sse2";
+    case SimdLevel::sse42:
+      return "sse4.2";
+    case SimdLevel::avx2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+bool simd_select(SimdLevel level) {
+  if (!cpu_supports(level)) return false;
+  kernels = kernels_for(level);
+  return true;
+}
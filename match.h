@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Match kernels shared by the match finders of all formats. The
+// implementation is picked once at startup from the CPU features, so every
+// entry point returns the same result on every host and only the speed
+// differs.
+
+enum class SimdLevel { scalar, sse2, sse42, avx2 };
+
+// Number of leading bytes that are equal in a and b, at most max_len.
+uint32_t match_length(const uint8_t* a, const uint8_t* b, uint32_t max_len);
+
+// Writes to out, in increasing order, every i in [0, count) for which
+// window[i..i+2] equals key[0..2], and returns how many were written.
+// window[count + 1] must be readable.
+size_t find_candidates(const uint8_t* window, size_t count, const uint8_t* key,
+                       uint32_t* out);
+
+// Copies a back-reference of n bytes that starts dist bytes behind dst, for
+// the decoders. Whole 16 or 8 byte blocks may write up to 15 bytes past
+// dst + n, but never past end.
+inline void copy_match(uint8_t* dst, uint32_t dist, uint32_t n,
+                       const uint8_t* end) {
+  const uint8_t* src = dst - dist;
+  size_t room = end - dst;
+
+  if (dist >= 16 && room >= ((n + 15) & ~15u)) {
+    for (uint32_t i = 0; i < n; i += 16) memcpy(dst + i, src + i, 16);
+  } else if (dist >= 8 && room >= ((n + 7) & ~7u)) {
+    for (uint32_t i = 0; i < n; i += 8) memcpy(dst + i, src + i, 8);
+  } else if (dist == 1) {
+    memset(dst, src[0], n);
+  } else if (dist < n) {
+    // the match repeats its first dist bytes, so double the copied part
+    memcpy(dst, src, dist);
+    for (uint32_t done = dist; done < n;) {
+      uint32_t chunk = done < n - done ? done : n - done;
+      memcpy(dst + done, dst, chunk);
+      done += chunk;
+    }
+  } else {
+    memcpy(dst, src, n);
+  }
+}
+
+SimdLevel simd_level();
+const char* simd_level_name(SimdLevel level);
+
+// Forces a specific kernel set, e.g. for benchmarks. Returns false and keeps
+// the current selection if the CPU does not support the requested level.
+bool simd_select(SimdLevel level);
+
+struct MatchCandidate {
+  uint32_t size;
+  uint32_t pos;
+};
+
+// Hash chain match finder over a 0x1000 byte window, used by every encoder:
+// each window position is linked to the previous position sharing the same
+// 3-byte hash, so candidates are visited nearest first without touching
+// unrelated window positions.
+//
+// The tables store positions offset by base. Starting on new input moves base
+// past the window of the previous one, so old entries fail the distance check
+// and the tables never need to be cleared between files.
+class HashChain {
+ public:
+  static constexpr uint32_t window_size = 0x1000;
+
+  HashChain() : head(hash_size), prev(window_size) {}
+
+  void reset(const uint8_t* new_src, size_t new_size) {
+    base += size + window_size + 1;
+    if (uint64_t(base) + new_size > UINT32_MAX) {
+      std::fill(head.begin(), head.end(), 0);
+      std::fill(prev.begin(), prev.end(), 0);
+      base = window_size + 1;
+    }
+    src = new_src;
+    size = new_size;
+  }
+
+  // insert every position in [pos, pos + count) into the chains
+  void insert(size_t pos, size_t count) {
+    size_t end = pos + count;
+    if (size < 2) return;
+    if (end > size - 2) end = size - 2;
+    for (; pos < end; pos++) {
+      uint32_t h = hash(pos);
+      uint32_t key = base + uint32_t(pos);
+      prev[key & window_mask] = head[h];
+      head[h] = key;
+    }
+  }
+
+  // longest match of at least 3 and at most max_len bytes, or 0
+  uint32_t longest_match(size_t pos, size_t max_len, size_t* match_pos) const {
+    size_t max_match_size = size - pos;
+    uint32_t best_match_size = 0;
+    size_t best_match_pos = 0;
+
+    if (max_match_size < 3) return 0;
+    if (max_match_size > max_len) max_match_size = max_len;
+
+    const uint8_t* cur = src + pos;
+    uint32_t key = base + uint32_t(pos);
+    uint32_t candidate = head[hash(pos)];
+    for (int depth = max_chain_depth; depth > 0; depth--) {
+      if (key - candidate > window_size) break;
+
+      const uint8_t* match = src + (candidate - base);
+      // reject quickly on the byte that would extend the current best match
+      if (match[best_match_size] == cur[best_match_size]) {
+        uint32_t current_size = match_length(match, cur, max_match_size);
+        if (current_size > best_match_size) {
+          best_match_size = current_size;
+          best_match_pos = candidate - base;
+          if (best_match_size == max_match_size) break;
+        }
+      }
+      candidate = prev[candidate & window_mask];
+    }
+
+    *match_pos = best_match_pos;
+    return best_match_size >= 3 ? best_match_size : 0;
+  }
+
+  // Every match that is longer than all nearer ones, nearest first, so the
+  // sizes grow; out needs room for max_len - 2 of them. Returns the count.
+  size_t find_matches(size_t pos, size_t max_len, MatchCandidate* out) const {
+    size_t max_match_size = size - pos;
+    if (max_match_size < 3) return 0;
+    if (max_match_size > max_len) max_match_size = max_len;
+
+    size_t count = 0;
+    uint32_t best_match_size = 2;
+    const uint8_t* cur = src + pos;
+    uint32_t key = base + uint32_t(pos);
+    uint32_t candidate = head[hash(pos)];
+    for (int depth = max_chain_depth; depth > 0; depth--) {
+      if (key - candidate > window_size) break;
+
+      const uint8_t* match = src + (candidate - base);
+      if (match[best_match_size] == cur[best_match_size]) {
+        uint32_t current_size = match_length(match, cur, max_match_size);
+        if (current_size > best_match_size) {
+          best_match_size = current_size;
+          out[count++] = {current_size, candidate - base};
+          if (best_match_size == max_match_size) break;
+        }
+      }
+      candidate = prev[candidate & window_mask];
+    }
+    return count;
+  }
+
+ private:
+  static constexpr int hash_bits = 15;
+  static constexpr uint32_t hash_size = 1 << hash_bits;
+  static constexpr uint32_t window_mask = window_size - 1;
+  static constexpr int max_chain_depth = 1024;
+
+  uint32_t hash(size_t pos) const {
+    uint32_t v = src[pos] << 16 | src[pos + 1] << 8 | src[pos + 2];
+    return (v * 2654435761u) >> (32 - hash_bits);
+  }
+
+  const uint8_t* src = nullptr;
+  size_t size = 0;
+  uint32_t base = 0;
+  std::vector<uint32_t> head;
+  std::vector<uint32_t> prev;
+};
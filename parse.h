@@ -0,0 +1,240 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "match.h"
+
+// Parsers shared by all encoders. They split src[start, end) into literals
+// and copies, using up to 0x1000 bytes before start as history, and hand
+// every token to a writer for the format:
+//
+//   void literal(uint8_t byte);
+//   void match(uint32_t size, uint32_t dist);  // dist counts from 0
+//   static uint32_t match_cost(uint32_t size); // in bits, code bit included
+//
+// A literal costs 9 bits in every format. Level 0 of the encoders is
+// parse_greedy, level 1 parse_lazy and level 2 OptimalParser.
+//
+// Every parser gives up and returns false, leaving the output unfinished, once
+// cancel, if given, turns true. It is looked at every CANCEL_INTERVAL bytes.
+#define LITERAL_COST 9
+#define CANCEL_INTERVAL 0x4000
+
+inline bool cancelled(const std::atomic<bool>* cancel) {
+  return cancel && cancel->load(std::memory_order_relaxed);
+}
+
+// takes the longest match at every position
+template <class Finder, class Writer>
+bool parse_greedy(Finder& finder, const uint8_t* src, size_t start,
+                  size_t end, uint32_t max_match, Writer& out,
+                  const std::atomic<bool>* cancel = nullptr) {
+  finder.reset(src, end);
+  size_t history =
+      start > HashChain::window_size ? start - HashChain::window_size : 0;
+  finder.insert(history, start - history);
+
+  size_t pos = start;
+  size_t check = start;
+  while (pos < end) {
+    if (pos >= check) {
+      if (cancelled(cancel)) return false;
+      check = pos + CANCEL_INTERVAL;
+    }
+    size_t match_pos;
+    uint32_t size = finder.longest_match(pos, max_match, &match_pos);
+    if (size < 3) {
+      finder.insert(pos, 1);
+      out.literal(src[pos++]);
+    } else {
+      out.match(size, uint32_t(pos - match_pos - 1));
+      finder.insert(pos, size);
+      pos += size;
+    }
+  }
+  return true;
+}
+
+// matches this long are taken without looking ahead
+#define LAZY_LIMIT 0x20
+
+// Before taking a match, looks one and two bytes ahead and emits literals
+// instead if a longer match starts there and codes its bytes more cheaply.
+template <class Writer>
+bool parse_lazy(HashChain& chain, const uint8_t* src, size_t start,
+                size_t end, uint32_t max_match, Writer& out,
+                const std::atomic<bool>* cancel = nullptr) {
+  chain.reset(src, end);
+  size_t history =
+      start > HashChain::window_size ? start - HashChain::window_size : 0;
+  chain.insert(history, start - history);
+
+  // every position before inserted is in the chains; inserting one twice
+  // would let it match itself
+  size_t inserted = start;
+  auto find = [&](size_t pos, size_t* match_pos) {
+    if (inserted < pos) {
+      chain.insert(inserted, pos - inserted);
+      inserted = pos;
+    }
+    return chain.longest_match(pos, max_match, match_pos);
+  };
+
+  size_t pos = start;
+  size_t check = start;
+  size_t match_pos;
+  uint32_t size = find(pos, &match_pos);
+  while (pos < end) {
+    if (pos >= check) {
+      if (cancelled(cancel)) return false;
+      check = pos + CANCEL_INTERVAL;
+    }
+    if (size < 3) {
+      out.literal(src[pos++]);
+      size = find(pos, &match_pos);
+      continue;
+    }
+
+    if (size < LAZY_LIMIT && size < max_match) {
+      // literals and a later match win if they cost fewer bits per byte
+      uint32_t bits = Writer::match_cost(size);
+      size_t next_pos;
+      uint32_t next = find(pos + 1, &next_pos);
+      uint32_t next_bits = LITERAL_COST + Writer::match_cost(next);
+      if (next > size && next_bits * size < bits * (next + 1)) {
+        out.literal(src[pos++]);
+        size = next;
+        match_pos = next_pos;
+        continue;
+      }
+      uint32_t after = find(pos + 2, &next_pos);
+      uint32_t after_bits = 2 * LITERAL_COST + Writer::match_cost(after);
+      if (after > size + 1 && after_bits * size < bits * (after + 2)) {
+        out.literal(src[pos]);
+        out.literal(src[pos + 1]);
+        pos += 2;
+        size = after;
+        match_pos = next_pos;
+        continue;
+      }
+    }
+
+    out.match(size, uint32_t(pos - match_pos - 1));
+    pos += size;
+    size = find(pos, &match_pos);
+  }
+  return true;
+}
+
+// Finds the cheapest sequence of tokens by dynamic programming over the
+// writer's real token costs, one block at a time so the tables stay small.
+// Keeps its tables between calls.
+class OptimalParser {
+ public:
+  template <class Writer>
+  bool parse(HashChain& chain, const uint8_t* src, size_t start, size_t end,
+             uint32_t max_match, Writer& out,
+             const std::atomic<bool>* cancel = nullptr) {
+    chain.reset(src, end);
+    size_t history =
+        start > HashChain::window_size ? start - HashChain::window_size : 0;
+    chain.insert(history, start - history);
+
+    for (size_t block = start; block < end; block += block_size) {
+      size_t block_end = end - block < block_size ? end : block + block_size;
+      if (!parse_block(chain, src, block, block_end, max_match, out,
+                       cancel)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t block_size = 0x40000;
+
+  template <class Writer>
+  bool parse_block(HashChain& chain, const uint8_t* src, size_t start,
+                   size_t end, uint32_t max_match, Writer& out,
+                   const std::atomic<bool>* cancel) {
+    size_t n = end - start;
+    price.assign(n + 1, UINT32_MAX);
+    last_size.resize(n + 1);
+    last_dist.resize(n + 1);
+    price[0] = 0;
+
+    MatchCandidate matches[0x111];
+    size_t check = 0;
+    for (size_t i = 0; i < n;) {
+      if (i >= check) {
+        if (cancelled(cancel)) return false;
+        check = i + CANCEL_INTERVAL;
+      }
+      size_t pos = start + i;
+      uint32_t here = price[i];
+      if (here + LITERAL_COST < price[i + 1]) {
+        price[i + 1] = here + LITERAL_COST;
+        last_size[i + 1] = 1;
+      }
+
+      uint32_t limit = n - i < max_match ? uint32_t(n - i) : max_match;
+      size_t count = chain.find_matches(pos, limit, matches);
+      // a match that cannot get any longer is taken as is; the positions it
+      // covers are not worth pricing
+      if (count && matches[count - 1].size == limit) {
+        const MatchCandidate& m = matches[count - 1];
+        relax<Writer>(i, here, m.size, m.size, uint32_t(pos - m.pos - 1));
+        chain.insert(pos, m.size);
+        i += m.size;
+        continue;
+      }
+
+      uint32_t from = 3;
+      for (size_t c = 0; c < count; c++) {
+        const MatchCandidate& m = matches[c];
+        relax<Writer>(i, here, from, m.size, uint32_t(pos - m.pos - 1));
+        from = m.size + 1;
+      }
+      chain.insert(pos, 1);
+      i++;
+    }
+
+    // walk back from the end, then emit front to back
+    path.clear();
+    for (size_t i = n; i > 0; i -= last_size[i]) path.push_back(uint32_t(i));
+    size_t i = 0;
+    for (size_t p = path.size(); p-- > 0;) {
+      size_t next = path[p];
+      if (last_size[next] == 1) {
+        out.literal(src[start + i]);
+      } else {
+        out.match(last_size[next], last_dist[next]);
+      }
+      i = next;
+    }
+    return true;
+  }
+
+  // prices copies of every size from from to to that start at i
+  template <class Writer>
+  void relax(size_t i, uint32_t here, uint32_t from, uint32_t to,
+             uint32_t dist) {
+    for (uint32_t size = from; size <= to; size++) {
+      uint32_t cost = here + Writer::match_cost(size);
+      if (cost < price[i + size]) {
+        price[i + size] = cost;
+        last_size[i + size] = uint16_t(size);
+        last_dist[i + size] = uint16_t(dist);
+      }
+    }
+  }
+
+  // cheapest cost of the first i bytes, and the last token on that path
+  std::vector<uint32_t> price;
+  std::vector<uint16_t> last_size;
+  std::vector<uint16_t> last_dist;
+  std::vector<uint32_t> path;
+};
@@ -0,0 +1,234 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+
+// longest first line or field, to bound what a bad client can make us buffer
+#define MAX_LINE 0x1000
+#define MAX_FIELDS 64
+
+// macOS has no such flag; the daemon ignores SIGPIPE there as everywhere
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+void Message::set(const std::string& name, const std::string& value) {
+  for (auto& field : fields) {
+    if (field.first == name) {
+      field.second = value;
+      return;
+    }
+  }
+  fields.emplace_back(name, value);
+}
+
+std::string Message::get(const std::string& name) const {
+  for (const auto& field : fields) {
+    if (field.first == name) return field.second;
+  }
+  return "";
+}
+
+// waits until fd is ready for events, or fails once deadline passes
+static bool wait_ready(int fd, short events, Deadline deadline) {
+  if (deadline == Deadline::max()) return true;
+  for (;;) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) return false;
+    pollfd p = {fd, events, 0};
+    int n = poll(&p, 1, int(std::min<long long>(left.count(), 1 << 30)));
+    if (n < 0 && errno == EINTR) continue;
+    return n > 0;
+  }
+}
+
+static bool wait_readable(int fd, Deadline deadline) {
+  return wait_ready(fd, POLLIN, deadline);
+}
+
+static bool read_all(int fd, uint8_t* data, size_t size, Deadline deadline) {
+  while (size) {
+    if (!wait_readable(fd, deadline)) return false;
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t size,
+                      Deadline deadline) {
+  // A blocking send only returns once all of it is taken, so with a deadline
+  // it sends what fits and polls for room for the rest
+  int flags = deadline == Deadline::max() ? 0 : MSG_DONTWAIT;
+  while (size) {
+    if (!wait_ready(fd, POLLOUT, deadline)) return false;
+    // a client that went away must not take the daemon down with SIGPIPE
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL | flags);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+      continue;
+    }
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Looks at what has arrived without taking it and then reads up to the end
+// of the line only, to leave the payload in the socket
+static bool read_line(int fd, std::string& line, Deadline deadline) {
+  line.clear();
+  for (;;) {
+    char peeked[256];
+    if (!wait_readable(fd, deadline)) return false;
+    ssize_t n = recv(fd, peeked, sizeof(peeked), MSG_PEEK);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    const char* end = static_cast<const char*>(memchr(peeked, '\n', n));
+    size_t take = end ? end - peeked + 1 : n;
+    if (!read_all(fd, reinterpret_cast<uint8_t*>(peeked), take, deadline)) {
+      return false;
+    }
+    line.append(peeked, end ? take - 1 : take);
+    if (line.size() > MAX_LINE) return false;
+    if (end) return true;
+  }
+}
+
+bool read_header(int fd, Message& message, size_t* payload_size,
+                 size_t max_payload, Deadline deadline) {
+  message = Message();
+  if (!read_line(fd, message.command, deadline) || message.command.empty()) {
+    return false;
+  }
+  std::string line;
+  for (;;) {
+    if (!read_line(fd, line, deadline)) return false;
+    if (line.empty()) break;
+    size_t space = line.find(' ');
+    if (space == std::string::npos || message.fields.size() >= MAX_FIELDS) {
+      return false;
+    }
+    message.fields.emplace_back(line.substr(0, space), line.substr(space + 1));
+  }
+
+  *payload_size = 0;
+  std::string size_field = message.get("size");
+  if (size_field.empty()) return true;
+  char* end;
+  unsigned long long size = strtoull(size_field.c_str(), &end, 10);
+  if (*end || size > max_payload) return false;
+  *payload_size = size;
+  return true;
+}
+
+bool read_payload(int fd, std::vector<uint8_t>& payload, size_t size,
+                  Deadline deadline) {
+  payload.resize(size);
+  return read_all(fd, payload.data(), size, deadline);
+}
+
+bool read_message(int fd, Message& message, std::vector<uint8_t>& payload,
+                  size_t max_payload, Deadline deadline) {
+  size_t size;
+  payload.clear();
+  return read_header(fd, message, &size, max_payload, deadline) &&
+         read_payload(fd, payload, size, deadline);
+}
+
+bool write_message(int fd, Message message, const uint8_t* payload,
+                   size_t size, Deadline deadline) {
+  message.set("size", std::to_string(size));
+  std::string header = message.command + "\n";
+  for (const auto& field : message.fields) {
+    header += field.first + " " + field.second + "\n";
+  }
+  header += "\n";
+  return write_all(fd, reinterpret_cast<const uint8_t*>(header.data()),
+                   header.size(), deadline) &&
+         write_all(fd, payload, size, deadline);
+}
+
+static bool socket_address(const std::string& path, sockaddr_un& address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Error: socket path %s is too long\n", path.c_str());
+    return false;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+int listen_unix(const std::string& path) {
+  sockaddr_un address;
+  if (!socket_address(path, address)) return -1;
+
+  // Only a socket file that nobody listens on any more is replaced: it was
+  // left by a daemon that did not shut down cleanly
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Error: %s exists and is not a socket\n", path.c_str());
+      return -1;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool live = probe >= 0 &&
+                connect(probe, reinterpret_cast<sockaddr*>(&address),
+                        sizeof(address)) == 0;
+    if (probe >= 0) close(probe);
+    if (live) {
+      fprintf(stderr, "Error: another daemon is listening on %s\n",
+              path.c_str());
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  // requests name files to read and write and can stop the daemon, so only
+  // the user it runs as may connect
+  mode_t mask = umask(0077);
+  bool bound =
+      bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+  umask(mask);
+  if (!bound || listen(fd, 64) < 0) {
+    perror(path.c_str());
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int connect_unix(const std::string& path) {
+  sockaddr_un address;
+  if (!socket_address(path, address)) return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) <
+      0) {
+    perror(path.c_str());
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Requests to the compressor daemon and its replies. On the socket a message
+// is a first line, "name value" lines, an empty line and then as many bytes
+// of payload as its size field says. Requests name the command on the first
+// line, replies say "ok" or "error" followed by the reason.
+struct Message {
+  std::string command;
+  std::vector<std::pair<std::string, std::string>> fields;
+
+  void set(const std::string& name, const std::string& value);
+  // empty if the field is missing
+  std::string get(const std::string& name) const;
+};
+
+// reads and writes fail once it passes
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// False if the connection closed or broke, the message is malformed, its
+// payload is larger than max_payload or it did not arrive by deadline
+bool read_message(int fd, Message& message, std::vector<uint8_t>& payload,
+                  size_t max_payload, Deadline deadline = Deadline::max());
+// The two halves of read_message, for readers that need the size of the
+// payload before they take it
+bool read_header(int fd, Message& message, size_t* payload_size,
+                 size_t max_payload, Deadline deadline = Deadline::max());
+bool read_payload(int fd, std::vector<uint8_t>& payload, size_t size,
+                  Deadline deadline = Deadline::max());
+// Sets the size field to size. False if the connection broke or the message
+// was not taken by deadline.
+bool write_message(int fd, Message message, const uint8_t* payload = nullptr,
+                   size_t size = 0, Deadline deadline = Deadline::max());
+
+// Unix domain stream sockets; both return -1 after printing the error
+int listen_unix(const std::string& path);
+int connect_unix(const std::string& path);
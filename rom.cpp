@@ -5,87 +5,104 @@
 #include <stdlib.h>
 #include <string.h>
 #include <algorithm>
-#include <fstream>
+#include <chrono>
+#include <utility>
 #include <vector>
 
+#include "crc.h"
+#include "findtable.h"
 #include "util.h"
 
 #define UINTSIZE 0x01000000
 #define COMPSIZE 0x02000000
 #define DCMPSIZE 0x04000000
 
-std::vector<uint8_t> loadROM(const std::string& name);
-void fix_crc(std::vector<uint8_t>& data);
-
-N64ROM::N64ROM(std::string file_name) : name(file_name) { load(); }
-
-void N64ROM::load() {
-  data = loadROM(name.c_str());
-  outdata = data;
-  outdata.resize(DCMPSIZE);
+N64ROM::N64ROM(std::string file_name, bool huge_pages)
+    : name(file_name), huge_pages(huge_pages) {
+  auto start = std::chrono::steady_clock::now();
+  load(Buffer::map_file(name), start);
+}
 
-  readTable();
+N64ROM::N64ROM(Buffer image, bool huge_pages) : huge_pages(huge_pages) {
+  load(std::move(image), std::chrono::steady_clock::now());
 }
 
-std::vector<uint8_t> loadROM(const std::string& name) {
-  std::vector<uint8_t> result;
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
 
-  std::ifstream romFile(name, std::ifstream::binary);
-  if (!romFile) {
-    perror(name.c_str());
+void N64ROM::load(Buffer image, std::chrono::steady_clock::time_point start) {
+  // a mapped file is private, so converting touches only our copy of the
+  // pages
+  data = std::move(image);
+  if (data.size() > DCMPSIZE) {
+    fprintf(stderr, "Error: the ROM is larger than %x bytes\n", DCMPSIZE);
     exit(1);
   }
+  order = detect_byte_order(data.data(), data.size());
+  convert_byte_order(data.data(), data.size(), order);
+  load_ms = elapsed_ms(start);
 
-  romFile.seekg(0, std::ios::end);
-  size_t size = romFile.tellg();
-  romFile.seekg(0, std::ios::beg);
+  start = std::chrono::steady_clock::now();
+  readTable();
+  table_ms = elapsed_ms(start);
+
+  // Every tool rewrites all files starting with the first one, so only the
+  // part before it has to be carried over
+  outdata = Buffer::allocate(DCMPSIZE, huge_pages);
+  size_t prefix = std::min(data.size(), outdata.size());
+  if (intable.size() > 3) prefix = std::min<size_t>(prefix, intable[3].startP);
+  memcpy(outdata.data(), data.data(), prefix);
+  load_ms += elapsed_ms(start) - table_ms;
+}
 
-  result.resize(size);
-  romFile.read(reinterpret_cast<char*>(result.data()), size);
+void N64ROM::read_input(size_t offset, size_t size, uint8_t* dest) const {
+  if (!input_dropped) {
+    memcpy(dest, data.data() + offset, size);
+    return;
+  }
 
-  uint16_t* tempROM = reinterpret_cast<uint16_t*>(result.data());
-  if (result[0] == 0x37) {
-    for (size_t i = 0; i < result.size() / 2; i++) {
-      tempROM[i] = byteSwap(tempROM[i]);
-    }
+  // the byte order converts in whole words, so read those around the range
+  size_t begin = offset & ~size_t(3);
+  size_t end = (offset + size + 3) & ~size_t(3);
+  std::vector<uint8_t> words(end - begin);
+  FILE* file = fopen(name.c_str(), "rb");
+  if (!file || fseek(file, long(begin), SEEK_SET) != 0) {
+    perror(name.c_str());
+    exit(1);
   }
+  // past the end of the file is zero, as in a mapping
+  fread(words.data(), 1, words.size(), file);
+  fclose(file);
+  convert_byte_order(words.data(), words.size(), order);
+  memcpy(dest, words.data() + (offset - begin), size);
+}
 
-  return result;
+void N64ROM::drop_input() {
+  // an image that did not come from a file has nowhere to be read back from
+  if (name.empty()) return;
+  data.drop_pages();
+  input_dropped = true;
 }
 
 size_t N64ROM::findTable() {
-  std::vector<uint8_t> marker{0x7A, 0x65, 0x6C, 0x64, 0x61,
-                              0x40, 0x73, 0x72, 0x64};
-  auto it = std::search(data.begin(), data.end(), marker.begin(), marker.end());
-
-  if (it == data.end()) {
+  size_t position;
+  if (!::findTable(data.data(), data.size(), &position)) {
     fprintf(stderr, "Error: Couldn't find file table\n");
     exit(1);
   }
-
-  it += 32;
-
-  std::vector<uint8_t> marker2{0x00, 0x00, 0x10, 0x60};
-  std::vector<uint8_t>::const_iterator final_position;
-  do {
-    final_position =
-        std::search(it, data.end(), marker2.begin(), marker2.end());
-    if (final_position != data.end()) {
-      break;
-    }
-    it += 16;
-  } while (final_position < data.end());
-
-  return final_position - data.begin() - 4;
+  return position;
 }
 
 void N64ROM::readTable() {
   table_position = findTable();
-  N64ROM::table_entry toc(data, table_position + 2 * sizeof(table_entry));
+  N64ROM::table_entry toc(data.data(), table_position + 2 * sizeof(table_entry));
   auto toc_entries = (toc.endV - toc.startV) / sizeof(N64ROM::table_entry);
   intable.reserve(toc_entries);
   for (int i = 0; i < toc_entries; i++) {
-    intable.emplace_back(data,
+    intable.emplace_back(data.data(),
                          table_position + sizeof(N64ROM::table_entry) * i);
   }
   outtable = intable;
@@ -94,17 +111,19 @@ void N64ROM::readTable() {
 void N64ROM::writeTable() {
   for (size_t i = 0; i < outtable.size(); ++i) {
     const table_entry& entry = outtable[i];
-    entry.write(outdata, table_position + sizeof(N64ROM::table_entry) * i);
+    entry.write(outdata.data(), table_position + sizeof(N64ROM::table_entry) * i);
   }
 }
 
-void N64ROM::save(const std::string& file_name) {
+void N64ROM::save(const std::string& file_name, ByteOrder file_order) {
   writeTable();
   fix_crc();
+  write(file_name, file_order);
+}
 
-  std::ofstream os(file_name, std::ofstream::out | std::ofstream::binary |
-                                  std::ofstream::trunc);
-  os.write(reinterpret_cast<const char*>(outdata.data()), outdata.size());
+void N64ROM::write(const std::string& file_name, ByteOrder file_order) {
+  convert_byte_order(outdata.data(), outdata.size(), file_order);
+  if (!write_file(file_name, outdata.data(), outdata.size())) exit(1);
 }
 
-void N64ROM::fix_crc() { ::fix_crc(outdata); }
+void N64ROM::fix_crc() { ::fix_crc(outdata.data(), outdata.size()); }
@@ -1,18 +1,20 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <string>
 #include <vector>
 
+#include "buffer.h"
+#include "byteorder.h"
 #include "util.h"
 
 class N64ROM {
  public:
   struct table_entry {
-    table_entry(const std::vector<uint8_t>& data, size_t pos) {
+    table_entry(const uint8_t* data, size_t pos) {
       static_assert(sizeof(table_entry) == 16);
-      const uint32_t* data32 =
-          reinterpret_cast<const uint32_t*>(data.data() + pos);
+      const uint32_t* data32 = reinterpret_cast<const uint32_t*>(data + pos);
       startV = bigendian(data32[0]);
       endV = bigendian(data32[1]);
       startP = bigendian(data32[2]);
@@ -24,8 +26,8 @@ class N64ROM {
     uint32_t startP; /* Start Physical Address */
     uint32_t endP;   /* End Phycical Address   */
 
-    void write(std::vector<uint8_t>& data, size_t pos) const {
-      uint32_t* data32 = reinterpret_cast<uint32_t*>(data.data() + pos);
+    void write(uint8_t* data, size_t pos) const {
+      uint32_t* data32 = reinterpret_cast<uint32_t*>(data + pos);
       data32[0] = bigendian(startV);
       data32[1] = bigendian(endV);
       data32[2] = bigendian(startP);
@@ -36,27 +38,59 @@ class N64ROM {
     uint32_t size() const { return endV - startV; }
   };
 
-  N64ROM(std::string file_name);
+  // huge_pages backs the output image with huge pages where available
+  N64ROM(std::string file_name, bool huge_pages = false);
+  // an image already in memory, in any byte order
+  N64ROM(Buffer image, bool huge_pages = false);
 
-  const std::vector<uint8_t>& in() const { return data; }
-  std::vector<uint8_t>& out() { return outdata; }
+  const Buffer& in() const { return data; }
+  // zero-filled except for everything before the first file, which is copied
+  // from the input
+  Buffer& out() { return outdata; }
+
+  // the order the input was stored in; in() is always big-endian
+  ByteOrder byte_order() const { return order; }
+
+  // Copies size bytes of the big-endian input at offset to dest. After
+  // drop_input, they are read from the file again instead.
+  void read_input(size_t offset, size_t size, uint8_t* dest) const;
+  // lets the system reclaim the pages of in(), which must not be used any
+  // more; read_input still works
+  void drop_input();
 
   void fix_crc();
-  void save(const std::string& file_name);
+  // writeTable, fix_crc and write
+  void save(const std::string& file_name,
+            ByteOrder file_order = ByteOrder::big);
+  // converts out() to file_order in place before writing it
+  void write(const std::string& file_name,
+             ByteOrder file_order = ByteOrder::big);
+
+  // milliseconds spent loading the file and reading its table
+  double load_time() const { return load_ms; }
+  double table_time() const { return table_ms; }
 
   void readTable();
   void writeTable();
+  // offset of the file table in both images
+  size_t table_offset() const { return table_position; }
   size_t entry_count() const { return intable.size(); }
   const table_entry& inEntry(size_t i) { return intable[i]; }
   table_entry& outEntry(size_t i) { return outtable[i]; }
 
  private:
-  void load();
+  void load(Buffer image, std::chrono::steady_clock::time_point start);
   size_t findTable();
 
   std::string name;
-  std::vector<uint8_t> data;
-  std::vector<uint8_t> outdata;
+  bool huge_pages;
+  bool input_dropped = false;
+  ByteOrder order;
+  Buffer data;
+  Buffer outdata;
+
+  double load_ms;
+  double table_ms;
 
   size_t table_position;
   std::vector<table_entry> intable;
@@ -0,0 +1,566 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "byteorder.h"
+#include "decompress.h"
+#include "findtable.h"
+#include "protocol.h"
+#include "rom.h"
+
+#define DCMPSIZE 0x4000000
+
+// waiting this long counts as one more priority, so nothing starves
+#define AGING_SECONDS 10
+// requested priorities are clamped to -MAX_PRIORITY..MAX_PRIORITY
+#define MAX_PRIORITY 100
+// jobs the latency figures are taken over
+#define LATENCY_WINDOW 1024
+// a client has this long to send its request, as long again for its payload
+// once there is room for it and as long to take the reply
+#define REQUEST_TIMEOUT 30
+// connections whose requests are read at the same time
+#define MAX_READERS 64
+// payload bytes of requests that are read, queued or running at once
+#define MAX_PAYLOAD_BYTES (8ull * DCMPSIZE)
+
+typedef std::chrono::steady_clock Clock;
+
+static double ms_since(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// A compress or decompress request waiting for its turn; the reply goes to
+// fd, which the job owns
+struct ServerJob {
+  int fd;
+  Message request;
+  std::vector<uint8_t> payload;
+  // taken from the PayloadBudget until the job is done
+  size_t reserved = 0;
+  int priority;
+  std::string client;
+  uint64_t sequence;
+  Clock::time_point queued;
+};
+
+// Picks the job with the highest priority, raised while it waits. Among
+// equals the client with the fewest running jobs goes first, then the one
+// served least recently, so one client's burst cannot hold up the others.
+class Scheduler {
+ public:
+  bool push(std::unique_ptr<ServerJob> job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (closed) return false;
+    job->sequence = next_sequence++;
+    jobs.push_back(std::move(job));
+    ready.notify_one();
+    return true;
+  }
+
+  // blocks until there is a job; null once closed and drained
+  std::unique_ptr<ServerJob> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return closed || !jobs.empty(); });
+    if (jobs.empty()) return nullptr;
+
+    auto now = Clock::now();
+    auto priority = [&](const ServerJob& job) {
+      auto waited = std::chrono::duration_cast<std::chrono::seconds>(
+          now - job.queued);
+      return job.priority + int(waited.count() / AGING_SECONDS);
+    };
+    auto best = jobs.begin();
+    for (auto it = jobs.begin() + 1; it != jobs.end(); ++it) {
+      const ServerJob& a = **it;
+      const ServerJob& b = **best;
+      int pa = priority(a), pb = priority(b);
+      if (pa != pb) {
+        if (pa > pb) best = it;
+        continue;
+      }
+      const Client& ca = clients[a.client];
+      const Client& cb = clients[b.client];
+      if (ca.running != cb.running) {
+        if (ca.running < cb.running) best = it;
+      } else if (ca.last_start != cb.last_start) {
+        if (ca.last_start < cb.last_start) best = it;
+      } else if (a.sequence < b.sequence) {
+        best = it;
+      }
+    }
+
+    std::unique_ptr<ServerJob> job = std::move(*best);
+    jobs.erase(best);
+    Client& client = clients[job->client];
+    client.running++;
+    client.last_start = ++starts;
+    running_count++;
+    return job;
+  }
+
+  void finished(const std::string& name) {
+    std::unique_lock<std::mutex> lock(mutex);
+    Client& client = clients[name];
+    running_count--;
+    if (--client.running == 0 && !waiting(name)) clients.erase(name);
+  }
+
+  // lets the drivers finish what is queued, then stop
+  void close() {
+    std::unique_lock<std::mutex> lock(mutex);
+    closed = true;
+    ready.notify_all();
+  }
+
+  size_t queued() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return jobs.size();
+  }
+
+  size_t running() const {
+    std::unique_lock<std::mutex> lock(mutex);
+    return running_count;
+  }
+
+ private:
+  struct Client {
+    size_t running = 0;
+    // when the client last got a driver, 0 for never
+    uint64_t last_start = 0;
+  };
+
+  bool waiting(const std::string& name) const {
+    for (const auto& job : jobs) {
+      if (job->client == name) return true;
+    }
+    return false;
+  }
+
+  mutable std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::unique_ptr<ServerJob>> jobs;
+  std::unordered_map<std::string, Client> clients;
+  uint64_t next_sequence = 0;
+  uint64_t starts = 0;
+  size_t running_count = 0;
+  bool closed = false;
+};
+
+// Bytes of request payloads the daemon holds at once. A reader waits for its
+// share before it reads the payload, which leaves the rest in the socket.
+class PayloadBudget {
+ public:
+  explicit PayloadBudget(uint64_t limit) : left(limit) {}
+
+  // size must not be more than the limit
+  void acquire(size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    freed.wait(lock, [&] { return size <= left; });
+    left -= size;
+  }
+
+  void release(size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    left += size;
+    freed.notify_all();
+  }
+
+ private:
+  std::mutex mutex;
+  std::condition_variable freed;
+  uint64_t left;
+};
+
+// Threads that read the request of one connection each
+class Readers {
+ public:
+  // false if there are as many as allowed already
+  bool start() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (running == MAX_READERS) return false;
+    running++;
+    return true;
+  }
+
+  // notifies under the lock, so wait_all cannot return before a finishing
+  // thread is done with this object
+  void finished() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (--running == 0) idle.notify_all();
+  }
+
+  void wait_all() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return running == 0; });
+  }
+
+ private:
+  std::mutex mutex;
+  std::condition_variable idle;
+  size_t running = 0;
+};
+
+// Counts and latencies of finished jobs
+class ServerMetrics {
+ public:
+  void record(bool ok, double queue_ms, double run_ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    (ok ? completed : failed)++;
+    if (queue_wait.size() == LATENCY_WINDOW) {
+      queue_wait.pop_front();
+      run.pop_front();
+    }
+    queue_wait.push_back(queue_ms);
+    run.push_back(run_ms);
+  }
+
+  std::string json(const Scheduler& scheduler, const ThreadPool& pool,
+                   const MemoryCache& cache) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    char text[1024];
+    snprintf(text, sizeof(text),
+             "{\"queued\": %zu, \"running\": %zu, \"completed\": %zu, "
+             "\"failed\": %zu, \"pool_pending\": %zu, \"queue_wait_ms\": "
+             "%s, \"run_ms\": %s, \"cache\": {\"entries\": %zu, \"bytes\": "
+             "%llu, \"hits\": %zu, \"misses\": %zu}}\n",
+             scheduler.queued(), scheduler.running(), completed, failed,
+             pool.pending(), summary(queue_wait).c_str(),
+             summary(run).c_str(), cache.entries(),
+             (unsigned long long)cache.bytes(), cache.hits(), cache.misses());
+    return text;
+  }
+
+ private:
+  static std::string summary(const std::deque<double>& values) {
+    std::vector<double> sorted(values.begin(), values.end());
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0;
+    for (double v : sorted) sum += v;
+    auto percentile = [&](double p) {
+      return sorted.empty() ? 0.0 : sorted[size_t(p * (sorted.size() - 1))];
+    };
+    char text[160];
+    snprintf(text, sizeof(text),
+             "{\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+             sorted.empty() ? 0.0 : sum / sorted.size(), percentile(0.5),
+             percentile(0.99), sorted.empty() ? 0.0 : sorted.back());
+    return text;
+  }
+
+  mutable std::mutex mutex;
+  size_t completed = 0;
+  size_t failed = 0;
+  std::deque<double> queue_wait;
+  std::deque<double> run;
+};
+
+// a client that stops reading only holds a driver until the deadline
+static bool send_reply(int fd, const Message& reply,
+                       const uint8_t* payload = nullptr, size_t size = 0) {
+  return write_message(fd, reply, payload, size,
+                       Clock::now() + std::chrono::seconds(REQUEST_TIMEOUT));
+}
+
+static bool reply_error(int fd, const std::string& reason) {
+  Message reply;
+  reply.command = "error " + reason;
+  return send_reply(fd, reply);
+}
+
+// The input of a job, from its payload or from the path in its input field,
+// converted to big-endian. Fails with a reason instead of exiting, which is
+// what N64ROM does with an image it cannot use.
+static bool load_input(ServerJob& job, Buffer& image, std::string& error) {
+  std::string path = job.request.get("input");
+  if (path.empty()) {
+    image = Buffer::allocate(job.payload.size());
+    if (image.size()) {
+      memcpy(image.data(), job.payload.data(), image.size());
+    }
+    std::vector<uint8_t>().swap(job.payload);
+  } else {
+    // opening a FIFO or a device could block or never end
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      error = "cannot read " + path;
+      return false;
+    }
+    if (st.st_size > DCMPSIZE) {
+      error = path + " is larger than a ROM can be";
+      return false;
+    }
+    if (!Buffer::map_file(path, image)) {
+      error = "cannot read " + path;
+      return false;
+    }
+  }
+
+  convert_byte_order(image.data(), image.size(),
+                     detect_byte_order(image.data(), image.size()));
+  size_t table;
+  if (!findTable(image.data(), image.size(), &table)) {
+    error = "no file table in the input";
+    return false;
+  }
+  // N64ROM reads as many entries as the third one says the table holds
+  size_t toc = table + 2 * sizeof(N64ROM::table_entry);
+  if (toc + sizeof(N64ROM::table_entry) > image.size()) {
+    error = "the file table is out of bounds";
+    return false;
+  }
+  N64ROM::table_entry entry(image.data(), toc);
+  if (entry.endV < entry.startV ||
+      table + (entry.endV - entry.startV) > image.size()) {
+    error = "the file table is out of bounds";
+    return false;
+  }
+  // everything before the first file is carried over to the output
+  if (entry.endV - entry.startV > 3 * sizeof(N64ROM::table_entry)) {
+    N64ROM::table_entry first(image.data(),
+                              table + 3 * sizeof(N64ROM::table_entry));
+    if (first.startP > image.size()) {
+      error = "the first file is out of bounds";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs one job and sends its reply: the output as payload when the request
+// has no output field, otherwise the output is written to that path
+static bool run_job(ServerJob& job, double queue_ms, const Options& options,
+                    const Context& context, std::string& error) {
+  const Message& request = job.request;
+  std::string output = request.get("output");
+  std::string name = request.get("input");
+  if (name.empty()) {
+    name = job.client + " #" + std::to_string(job.sequence);
+  }
+
+  Buffer image;
+  if (!load_input(job, image, error)) return false;
+
+  Message reply;
+  reply.command = "ok";
+  reply.set("queue-ms", std::to_string(queue_ms));
+  Clock::time_point start = Clock::now();
+
+  if (request.command == "decompress") {
+    N64ROM rom(std::move(image), options.huge_pages);
+    if (!decompress_rom(rom, *context.pool)) {
+      error = "the input is corrupt";
+      return false;
+    }
+    rom.writeTable();
+    rom.fix_crc();
+    reply.set("run-ms", std::to_string(ms_since(start)));
+    if (!output.empty()) {
+      if (!write_file(output, rom.out().data(), rom.out().size())) {
+        error = "cannot write " + output;
+        return false;
+      }
+      return send_reply(job.fd, reply);
+    }
+    return send_reply(job.fd, reply, rom.out().data(), rom.out().size());
+  }
+
+  Options job_options = options;
+  std::string level = request.get("level");
+  if (!level.empty()) {
+    job_options.level = atoi(level.c_str());
+    if (job_options.level < 0 || job_options.level > CODEC_MAX_LEVEL) {
+      error = "no level " + level;
+      return false;
+    }
+  }
+  std::string format = request.get("format");
+  if (!format.empty() && !parse_format(format, &job_options.format)) {
+    error = "no format " + format;
+    return false;
+  }
+
+  // the output streams into memory unless it goes to a file
+  char* memory = nullptr;
+  size_t memory_size = 0;
+  FILE* file = output.empty() ? open_memstream(&memory, &memory_size)
+                              : fopen(output.c_str(), "wb");
+  if (!file) {
+    error = "cannot write " + (output.empty() ? "to memory" : output);
+    return false;
+  }
+  bool compressed =
+      compress(name, output, job_options, context,
+               std::unique_ptr<OutputFile>(new OutputFile(file, name)),
+               std::move(image), &error);
+  reply.set("run-ms", std::to_string(ms_since(start)));
+  bool sent = false;
+  if (compressed) {
+    sent = output.empty()
+               ? send_reply(job.fd, reply,
+                            reinterpret_cast<uint8_t*>(memory), memory_size)
+               : send_reply(job.fd, reply);
+  }
+  free(memory);
+  return compressed && sent;
+}
+
+int serve(const std::string& path, const Options& options,
+          const Context& context, MemoryCache& cache, int max_jobs) {
+  signal(SIGPIPE, SIG_IGN);
+  int listener = listen_unix(path);
+  if (listener < 0) return 1;
+  // a shutdown request writes to wake[1] to stop the accept loop
+  int wake[2];
+  if (pipe(wake) < 0) {
+    perror("pipe");
+    close(listener);
+    return 1;
+  }
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+  Scheduler scheduler;
+  ServerMetrics metrics;
+  PayloadBudget budget(MAX_PAYLOAD_BYTES);
+  Readers readers;
+  std::vector<std::thread> drivers;
+  for (int d = 0; d < max_jobs; d++) {
+    drivers.emplace_back([&] {
+      while (std::unique_ptr<ServerJob> job = scheduler.pop()) {
+        double queue_ms = ms_since(job->queued);
+        Clock::time_point start = Clock::now();
+        std::string error;
+        bool ok = run_job(*job, queue_ms, options, context, error);
+        if (!ok && !error.empty()) {
+          printf("%s: %s\n", job->client.c_str(), error.c_str());
+          reply_error(job->fd, error);
+        } else if (!ok) {
+          // the job ran, but the client went away or did not take the reply
+          printf("%s: cannot send the reply\n", job->client.c_str());
+        }
+        metrics.record(ok, queue_ms, ms_since(start));
+        close(job->fd);
+        budget.release(job->reserved);
+        scheduler.finished(job->client);
+      }
+    });
+  }
+
+  // Runs on a thread of its own for every connection, so a client that is
+  // slow to send its request only holds up itself
+  auto read_request = [&](int fd) {
+    std::unique_ptr<ServerJob> job(new ServerJob);
+    job->fd = fd;
+    size_t size;
+    if (!read_header(fd, job->request, &size, DCMPSIZE,
+                     Clock::now() + std::chrono::seconds(REQUEST_TIMEOUT))) {
+      reply_error(fd, "malformed request");
+      close(fd);
+      return;
+    }
+
+    const std::string& command = job->request.command;
+    if (command == "stats") {
+      std::string json = metrics.json(scheduler, *context.pool, cache);
+      Message reply;
+      reply.command = "ok";
+      send_reply(fd, reply, reinterpret_cast<const uint8_t*>(json.data()),
+                 json.size());
+      close(fd);
+    } else if (command == "shutdown") {
+      Message reply;
+      reply.command = "ok";
+      send_reply(fd, reply);
+      close(fd);
+      char byte = 0;
+      if (write(wake[1], &byte, 1) < 0) perror("write");
+    } else if (command == "compress" || command == "decompress") {
+      // waiting for room does not count against the client's time
+      budget.acquire(size);
+      if (!read_payload(fd, job->payload, size,
+                        Clock::now() +
+                            std::chrono::seconds(REQUEST_TIMEOUT))) {
+        budget.release(size);
+        reply_error(fd, "malformed request");
+        close(fd);
+        return;
+      }
+      job->reserved = size;
+      job->queued = Clock::now();
+      // far from overflowing once aging adds to it
+      long priority = strtol(job->request.get("priority").c_str(), nullptr, 10);
+      job->priority = int(std::clamp<long>(priority, -MAX_PRIORITY,
+                                           MAX_PRIORITY));
+      job->client = job->request.get("client");
+      if (job->client.empty()) job->client = "anonymous";
+      // the scheduler only closes once every reader is done
+      scheduler.push(std::move(job));
+    } else {
+      reply_error(fd, "unknown command " + command);
+      close(fd);
+    }
+  };
+
+  printf("Listening on %s, %d ROMs at a time\n", path.c_str(), max_jobs);
+  fflush(stdout);
+
+  for (;;) {
+    pollfd fds[2] = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      break;
+    }
+    if (fds[1].revents) break;
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ||
+          errno == EWOULDBLOCK) {
+        continue;
+      }
+      perror("accept");
+      break;
+    }
+    // accepted sockets do not inherit O_NONBLOCK on every system
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if (!readers.start()) {
+      reply_error(fd, "too many connections");
+      close(fd);
+      continue;
+    }
+    std::thread([&read_request, &readers, fd] {
+      read_request(fd);
+      readers.finished();
+    }).detach();
+  }
+
+  // requests still being read and queued jobs still run
+  close(listener);
+  unlink(path.c_str());
+  readers.wait_all();
+  scheduler.close();
+  for (auto& driver : drivers) driver.join();
+  close(wake[0]);
+  close(wake[1]);
+  return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+#include "cache.h"
+#include "compressor.h"
+
+// Runs the compressor as a daemon on the Unix domain socket path until a
+// shutdown request. Every job shares the pool of context and cache, which
+// context uses as its cache too, and max_jobs ROMs are worked on at a time:
+// the highest priority first, taking turns between clients of the same
+// priority. Returns the exit status.
+int serve(const std::string& path, const Options& options,
+          const Context& context, MemoryCache& cache, int max_jobs);
@@ -0,0 +1,110 @@
+#include "sha256.h"
+
+#include <string.h>
+
+#include "readwrite.h"
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+SHA256::SHA256() : buffered(0), length(0) {
+  static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+  memcpy(state, initial, sizeof(state));
+}
+
+void SHA256::transform(const uint8_t* block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) w[i] = U32(block + 4 * i);
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + round_constants[i] + w[i];
+    uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void SHA256::update(const uint8_t* data, size_t size) {
+  length += size;
+  if (buffered) {
+    size_t n = 64 - buffered < size ? 64 - buffered : size;
+    memcpy(buffer + buffered, data, n);
+    buffered += n;
+    data += n;
+    size -= n;
+    if (buffered < 64) return;
+    transform(buffer);
+    buffered = 0;
+  }
+  for (; size >= 64; data += 64, size -= 64) transform(data);
+  memcpy(buffer, data, size);
+  buffered = size;
+}
+
+SHA256::Digest SHA256::finish() {
+  uint64_t bits = length * 8;
+  uint8_t padding[72] = {0x80};
+  size_t pad = (buffered < 56 ? 56 : 120) - buffered;
+  for (int i = 0; i < 8; i++) padding[pad + i] = bits >> (56 - 8 * i);
+  update(padding, pad + 8);
+
+  Digest digest;
+  for (int i = 0; i < 8; i++) W32(digest.data() + 4 * i, state[i]);
+  return digest;
+}
+
+SHA256::Digest SHA256::hash(const uint8_t* data, size_t size) {
+  SHA256 sha;
+  sha.update(data, size);
+  return sha.finish();
+}
+
+std::string SHA256::hex(const Digest& digest) {
+  static const char digits[] = "0123456789abcdef";
+  std::string result;
+  for (uint8_t byte : digest) {
+    result += digits[byte >> 4];
+    result += digits[byte & 0xF];
+  }
+  return result;
+}
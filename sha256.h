@@ -0,0 +1,26 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class SHA256 {
+ public:
+  typedef std::array<uint8_t, 32> Digest;
+
+  SHA256();
+  void update(const uint8_t* data, size_t size);
+  Digest finish();
+
+  static Digest hash(const uint8_t* data, size_t size);
+  static std::string hex(const Digest& digest);
+
+ private:
+  void transform(const uint8_t* block);
+
+  uint32_t state[8];
+  uint8_t buffer[64];
+  size_t buffered;
+  uint64_t length;
+};
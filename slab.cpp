@@ -0,0 +1,21 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <string.h>
+
+OutputSlab::OutputSlab(size_t capacity, bool huge_pages)
+    : region(Buffer::allocate(capacity, huge_pages)), offset(0) {}
+
+Blob OutputSlab::copy(const uint8_t* data, size_t size) {
+  size_t start = offset.fetch_add(size);
+  if (start + size > region.size()) {
+    // copies that start past the end stay quiet
+    if (start <= region.size()) {
+      fprintf(stderr, "Error: output slab of %zx bytes is full\n",
+              region.size());
+    }
+    return Blob();
+  }
+  memcpy(region.data() + start, data, size);
+  return {region.data() + start, size};
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "buffer.h"
+
+// Compressed bytes of one file, owned by an OutputSlab or a result Buffer
+struct Blob {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+};
+
+// One region that receives the compressed files of a ROM, so results do not
+// need an allocation each. Space is handed out by bumping an atomic offset
+// and is only given back when the slab is destroyed; the region is reserved
+// at its worst-case size, but pages are only backed once they are written.
+class OutputSlab {
+ public:
+  explicit OutputSlab(size_t capacity, bool huge_pages = false);
+
+  // Safe to call from any thread. Returns an empty Blob once the slab is
+  // full, which it then stays.
+  Blob copy(const uint8_t* data, size_t size);
+  bool full() const { return offset > region.size(); }
+  size_t used() const { return offset; }
+  size_t capacity() const { return region.size(); }
+
+ private:
+  Buffer region;
+  std::atomic<size_t> offset;
+};
@@ -0,0 +1,217 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<uint64_t> heap_allocation_count(0);
+
+// counts every allocation; the array and nothrow forms end up here too
+void* operator new(size_t size) {
+  heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+uint64_t heap_allocations() { return heap_allocation_count; }
+
+size_t current_rss() {
+#ifdef __linux__
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  unsigned long size, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+  fclose(f);
+  return size_t(resident) * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+size_t peak_rss() {
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  // in kilobytes everywhere else
+  return size_t(usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+RunStats::RunStats() : origin(std::chrono::steady_clock::now()) {}
+
+double RunStats::now() const {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - origin)
+      .count();
+}
+
+void RunStats::phase(const std::string& name, double start, double end,
+                     bool background) {
+  phases.push_back({name, 0, background ? 1 : 0, start, end});
+}
+
+void RunStats::span(const std::string& name, size_t index, int worker,
+                    double start, double end) {
+  std::unique_lock<std::mutex> lock(mutex);
+  spans.push_back({name, index, worker, start, end});
+}
+
+bool RunStats::write_json(const std::string& file_name, int threads) const {
+  FILE* f = fopen(file_name.c_str(), "w");
+  if (!f) {
+    perror(file_name.c_str());
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+
+  fprintf(f, "{\n  \"threads\": %d,\n", threads);
+  fprintf(f,
+          "  \"allocations\": {\"heap\": %llu, \"arena\": %llu, "
+          "\"slab_used\": %zu, \"slab_capacity\": %zu, "
+          "\"peak_rss\": %zu},\n",
+          (unsigned long long)allocations.heap,
+          (unsigned long long)allocations.arena, allocations.slab_used,
+          allocations.slab_capacity, allocations.peak_rss);
+  fprintf(f, "  \"phases\": [\n");
+  for (size_t i = 0; i < phases.size(); i++) {
+    const Span& p = phases[i];
+    fprintf(f,
+            "    {\"name\": \"%s\", \"start_ms\": %.3f, \"duration_ms\": "
+            "%.3f, \"background\": %s}%s\n",
+            p.name.c_str(), p.start, p.end - p.start,
+            p.worker ? "true" : "false",
+            i + 1 < phases.size() ? "," : "");
+  }
+
+  fprintf(f, "  ],\n  \"entries\": [\n");
+  bool first = true;
+  for (size_t i = 0; i < entries.size(); i++) {
+    const EntryStats& e = entries[i];
+    if (!e.compressed) continue;
+    fprintf(f,
+            "%s    {\"index\": %zu, \"size\": %u, \"compressed_size\": %zu, "
+            "\"ratio\": %.4f, \"level\": %d, \"cached\": %s, \"reused\": "
+            "%s, \"shared\": %s, \"worker\": %d, \"segments\": %d, "
+            "\"queue_wait_ms\": %.3f, \"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+            first ? "" : ",\n", i, e.size, e.compressed_size,
+            e.size ? double(e.compressed_size) / e.size : 0.0, e.level,
+            e.cached ? "true" : "false", e.reused ? "true" : "false",
+            e.shared ? "true" : "false", e.worker, e.segments,
+            e.start - e.queued, e.end - e.start, e.cpu);
+    first = false;
+  }
+
+  // share of the pool that was busy, in 100 equal steps over the time the
+  // workers ran
+  fprintf(f, "\n  ],\n  \"utilization\": [\n");
+  if (!spans.empty() && threads > 0) {
+    double begin = spans[0].start, end = spans[0].end;
+    for (const Span& s : spans) {
+      begin = std::min(begin, s.start);
+      end = std::max(end, s.end);
+    }
+    const int steps = 100;
+    double width = std::max((end - begin) / steps, 1e-6);
+    std::vector<double> busy(steps);
+    for (const Span& s : spans) {
+      for (int b = int((s.start - begin) / width);
+           b < steps && begin + b * width < s.end; b++) {
+        double lo = std::max(s.start, begin + b * width);
+        double hi = std::min(s.end, begin + (b + 1) * width);
+        if (hi > lo) busy[b] += hi - lo;
+      }
+    }
+    for (int b = 0; b < steps; b++) {
+      fprintf(f, "    {\"start_ms\": %.3f, \"busy\": %.4f}%s\n",
+              begin + b * width, busy[b] / (width * threads),
+              b + 1 < steps ? "," : "");
+    }
+  }
+  fprintf(f, "  ]\n}\n");
+  return fclose(f) == 0;
+}
+
+bool RunStats::write_trace(const std::string& file_name, int threads) const {
+  FILE* f = fopen(file_name.c_str(), "w");
+  if (!f) {
+    perror(file_name.c_str());
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+
+  // main thread is tid 0, worker n is tid n + 1 and background phases come
+  // after the workers; times are in microseconds
+  fprintf(f, "{\"traceEvents\": [\n");
+  fprintf(f,
+          "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": "
+          "{\"name\": \"compressor\"}},\n");
+  fprintf(f,
+          "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+          "\"args\": {\"name\": \"main\"}}");
+  for (int i = 0; i < threads; i++) {
+    fprintf(f,
+            ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"worker %d\"}}",
+            i + 1, i);
+  }
+  fprintf(f,
+          ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+          "%d, \"args\": {\"name\": \"pool\"}}",
+          threads + 1);
+
+  for (const Span& p : phases) {
+    fprintf(f,
+            ",\n{\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": "
+            "1, \"tid\": %d, \"ts\": %.1f, \"dur\": %.1f}",
+            p.name.c_str(), p.worker ? threads + 1 : 0, p.start * 1000,
+            (p.end - p.start) * 1000);
+  }
+
+  struct Edge {
+    double time;
+    int delta;
+  };
+  std::vector<Edge> edges;
+  for (const Span& s : spans) {
+    const EntryStats& e = entries[s.index];
+    fprintf(f,
+            ",\n{\"name\": \"%s\", \"cat\": \"encode\", \"ph\": \"X\", "
+            "\"pid\": 1, \"tid\": %d, \"ts\": %.1f, \"dur\": %.1f, \"args\": "
+            "{\"index\": %zu, \"size\": %u, \"compressed_size\": %zu, "
+            "\"queue_wait_ms\": %.3f}}",
+            s.name.c_str(), s.worker + 1, s.start * 1000,
+            (s.end - s.start) * 1000, s.index, e.size, e.compressed_size,
+            s.start - e.queued);
+    edges.push_back({s.start, 1});
+    edges.push_back({s.end, -1});
+  }
+
+  // busy worker counter
+  std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+    return a.time < b.time || (a.time == b.time && a.delta < b.delta);
+  });
+  int busy = 0;
+  for (const Edge& edge : edges) {
+    busy += edge.delta;
+    fprintf(f,
+            ",\n{\"name\": \"busy workers\", \"ph\": \"C\", \"pid\": 1, "
+            "\"ts\": %.1f, \"args\": {\"busy\": %d}}",
+            edge.time * 1000, busy);
+  }
+
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What happened to one table entry. Times are in milliseconds since the
+// run started.
+struct EntryStats {
+  bool compressed = false;
+  bool cached = false;
+  // copied from the reference ROM
+  bool reused = false;
+  // encoded by another ROM of the batch
+  bool shared = false;
+  uint32_t size = 0;
+  size_t compressed_size = 0;
+  // of the encoder that produced the data
+  int level = 0;
+  // -1 when the entry was split over several workers
+  int worker = -1;
+  int segments = 0;
+  double queued = 0;
+  double start = 0;
+  double end = 0;
+  // summed over all segments
+  double cpu = 0;
+};
+
+// Memory requests of one compressor run
+struct AllocationStats {
+  // calls to operator new anywhere in the process
+  uint64_t heap = 0;
+  // times a worker arena had to grow
+  uint64_t arena = 0;
+  // output slab bytes written and reserved
+  size_t slab_used = 0;
+  size_t slab_capacity = 0;
+  // highest resident set of the process so far, in bytes
+  size_t peak_rss = 0;
+};
+
+// operator new calls since the process started
+uint64_t heap_allocations();
+// Resident set of the process now and at its highest, in bytes; 0 where the
+// platform does not tell
+size_t current_rss();
+size_t peak_rss();
+
+// Timing records of one compressor run, written either as plain JSON or as
+// a Chrome trace for chrome://tracing and Perfetto.
+class RunStats {
+ public:
+  RunStats();
+
+  void set_entry_count(size_t count) { entries.resize(count); }
+  double now() const;
+  // a step of the main thread; background steps overlap the others and get
+  // their own row in the trace
+  void phase(const std::string& name, double start, double end,
+             bool background = false);
+  // a piece of work on a pool worker, safe to call from any thread
+  void span(const std::string& name, size_t index, int worker, double start,
+            double end);
+  EntryStats& entry(size_t i) { return entries[i]; }
+  void set_allocations(const AllocationStats& a) { allocations = a; }
+
+  bool write_json(const std::string& file_name, int threads) const;
+  bool write_trace(const std::string& file_name, int threads) const;
+
+ private:
+  struct Span {
+    std::string name;
+    size_t index;
+    // for phases: 0 for the main row, 1 for the background row
+    int worker;
+    double start;
+    double end;
+  };
+
+  std::chrono::steady_clock::time_point origin;
+  std::vector<EntryStats> entries;
+  AllocationStats allocations;
+  std::vector<Span> phases;
+  mutable std::mutex mutex;
+  std::vector<Span> spans;
+};
@@ -0,0 +1,112 @@
+#!/bin/sh
+# Runs compressor --serve on a socket in a temporary directory and checks that
+# compressing and decompressing through compressor_client, by path and with
+# --send, gives the same bytes as the command line tools.
+#
+# usage: daemon_test.sh compressor compressor_client decompressor make_test_rom
+set -e
+compressor=$1
+client=$2
+decompressor=$3
+make_test_rom=$4
+
+dir=$(mktemp -d)
+socket=$dir/daemon.sock
+daemon=
+cleanup() {
+  if [ -n "$daemon" ]; then kill "$daemon" 2>/dev/null || true; fi
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  echo "daemon output:"
+  cat "$dir/daemon.log"
+  exit 1
+}
+
+"$make_test_rom" "$dir/rom.z64"
+"$compressor" "$dir/rom.z64" "$dir/cli-comp.z64" > /dev/null
+"$decompressor" "$dir/cli-comp.z64" "$dir/cli-decomp.z64"
+
+# one job at a time on one thread, so the order of jobs can be checked
+"$compressor" --threads 1 --batch-roms 1 --serve "$socket" \
+    > "$dir/daemon.log" 2>&1 &
+daemon=$!
+tries=0
+while [ ! -S "$socket" ]; do
+  tries=$((tries + 1))
+  [ $tries -le 100 ] || fail "the daemon did not start"
+  sleep 0.1
+done
+
+run() {
+  "$client" --socket "$socket" "$@" > /dev/null || fail "client $*"
+}
+# the number the daemon's stats give for a field
+stat() {
+  "$client" --socket "$socket" stats |
+    sed -n "s/.*\"$1\": \([0-9]*\).*/\1/p"
+}
+wait_stat() {
+  tries=0
+  while [ "$(stat "$1")" != "$2" ]; do
+    tries=$((tries + 1))
+    [ $tries -le 200 ] || fail "$3"
+    sleep 0.05
+  done
+}
+run compress "$dir/rom.z64" "$dir/path-comp.z64"
+run --send compress "$dir/rom.z64" "$dir/send-comp.z64"
+run decompress "$dir/cli-comp.z64" "$dir/path-decomp.z64"
+run --send decompress "$dir/cli-comp.z64" "$dir/send-decomp.z64"
+cmp "$dir/cli-comp.z64" "$dir/path-comp.z64" || fail "compress by path"
+cmp "$dir/cli-comp.z64" "$dir/send-comp.z64" || fail "compress with --send"
+cmp "$dir/cli-decomp.z64" "$dir/path-decomp.z64" || fail "decompress by path"
+cmp "$dir/cli-decomp.z64" "$dir/send-decomp.z64" ||
+  fail "decompress with --send"
+
+# a request that fails gets an error and leaves the daemon running
+if "$client" --socket "$socket" compress "$dir/missing.z64" \
+    "$dir/missing-comp.z64" 2> /dev/null; then
+  fail "compressing a missing file succeeded"
+fi
+
+"$client" --socket "$socket" stats > "$dir/stats.json" || fail "stats"
+grep -q '"completed": 4, "failed": 1' "$dir/stats.json" ||
+  fail "stats: $(cat "$dir/stats.json")"
+for field in queue_wait_ms run_ms; do
+  grep -q "\"$field\": {\"mean\": [0-9.]*, \"p50\": [0-9.]*, \"p99\"" \
+      "$dir/stats.json" || fail "no $field in stats: $(cat "$dir/stats.json")"
+done
+# the second compress found every file of the first in the memory cache
+[ "$(stat hits)" -gt 0 ] || fail "no cache hits"
+
+# A job at high priority that arrives behind one at low priority runs first.
+# The job in front keeps the daemon busy meanwhile: level 2 on one thread
+# takes seconds.
+"$client" --socket "$socket" --level 2 compress "$dir/rom.z64" \
+    "$dir/busy.z64" > /dev/null &
+busy=$!
+wait_stat running 1 "the first job did not start"
+("$client" --socket "$socket" --level 1 --priority -5 compress \
+    "$dir/rom.z64" "$dir/low.z64" > /dev/null && echo low >> "$dir/order") &
+low=$!
+wait_stat queued 1 "the low priority job was not queued"
+("$client" --socket "$socket" --level 1 --priority 5 compress \
+    "$dir/rom.z64" "$dir/high.z64" > /dev/null && echo high >> "$dir/order") &
+high=$!
+wait_stat queued 2 "the first job finished before the others were queued"
+wait "$busy" || fail "the first job failed"
+wait "$low" || fail "the low priority job failed"
+wait "$high" || fail "the high priority job failed"
+[ "$(cat "$dir/order")" = "$(printf 'high\nlow')" ] ||
+  fail "jobs finished in the order $(cat "$dir/order")"
+cmp "$dir/low.z64" "$dir/high.z64" || fail "the same job gave different output"
+
+run shutdown
+wait "$daemon" || fail "the daemon exited with $?"
+daemon=
+[ ! -e "$socket" ] || fail "the socket is still there after shutdown"
+echo "daemon matches the command line tools"
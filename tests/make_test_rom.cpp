@@ -0,0 +1,64 @@
+// Writes a small ROM with the layout the tools expect, so the tests need no
+// real one: a file table after the build string, files stored uncompressed at
+// their virtual addresses and a compression index behind them, as the
+// decompressor leaves it.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "buffer.h"
+
+#define TABLE 0x7430
+#define FILES 48
+
+static void put32(std::vector<uint8_t>& rom, size_t pos, uint32_t value) {
+  for (int i = 0; i < 4; i++) rom[pos + i] = uint8_t(value >> (24 - 8 * i));
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s outfile\n", argv[0]);
+    return 1;
+  }
+  const size_t entries = FILES + 4;
+  std::vector<uint8_t> rom(0x1000000);
+  memcpy(&rom[TABLE - 0x30], "zelda@srd", 9);
+
+  uint32_t seed = 12345;
+  auto next = [&seed] { return seed = seed * 1103515245 + 12345; };
+  static const char* const words[] = {"link", "zelda", "ganon", "rupee",
+                                      "hylian", "shield", "ocarina", "time"};
+
+  // the header and boot code, the code before the table and the table
+  std::vector<uint32_t> start = {0, 0x1060, TABLE};
+  std::vector<uint32_t> end = {0x1060, TABLE, uint32_t(TABLE + entries * 16)};
+  start.resize(entries);
+  end.resize(entries);
+  uint32_t pos = 0x10000;
+  for (size_t i = 3; i < entries - 1; i++) {
+    // mostly small files, a few above the default split threshold
+    size_t size = i % 16 == 5 ? 0x90000 + (next() >> 16) * 4
+                              : 0x100 + (next() >> 12) % 0x20000;
+    size &= ~size_t(15);
+    start[i] = pos;
+    end[i] = pos + uint32_t(size);
+    for (size_t at = pos; at < end[i];) {
+      const char* word = words[(next() >> 16) % 8];
+      for (; *word && at < end[i]; word++) rom[at++] = uint8_t(*word);
+      if (at < end[i]) rom[at++] = uint8_t(next() >> 24);
+    }
+    pos = (end[i] + 0xFFF) & ~0xFFFu;
+  }
+
+  for (size_t i = 0; i < entries - 1; i++) {
+    put32(rom, TABLE + i * 16, start[i]);
+    put32(rom, TABLE + i * 16 + 4, end[i]);
+    put32(rom, TABLE + i * 16 + 8, start[i]);
+  }
+  // the last entry points at the compression index, every fourth file stays
+  // uncompressed
+  put32(rom, TABLE + (entries - 1) * 16 + 8, pos);
+  for (size_t i = 3; i < entries - 1; i++) rom[pos + i] = i % 4 != 0;
+  return write_file(argv[1], rom.data(), rom.size()) ? 0 : 1;
+}
@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "match.h"
+#include "parse.h"
+#include "readwrite.h"
+#include "yaz0.h"
+
+#include "yay0.h"
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+// magic and longest copy of each format
+template <SplitStreamFormat format>
+struct SplitStream;
+
+template <>
+struct SplitStream<SplitStreamFormat::yay0> {
+  static constexpr const char* magic = "Yay0";
+  static constexpr u32 max_match = 0x111;
+};
+
+template <>
+struct SplitStream<SplitStreamFormat::mio0> {
+  static constexpr const char* magic = "MIO0";
+  static constexpr u32 max_match = 0x12;
+};
+
+// one code word per 32 tokens, and a token never takes more bytes than it
+// decodes to
+size_t yay0_bound(size_t src_size) {
+  return 16 + (src_size + 31) / 32 * 4 + src_size + 15;
+}
+
+// Writes the code words straight to dest, which they start, and collects the
+// copies and literals until their offsets are known
+template <SplitStreamFormat format>
+class SplitStreamWriter {
+ public:
+  SplitStreamWriter(u8* dest, std::vector<u8>& links, std::vector<u8>& chunks)
+      : dest(dest), masks(dest + 16), links(links), chunks(chunks) {
+    links.clear();
+    chunks.clear();
+  }
+
+  // Yay0 stores the length of copies from 0x12 bytes on in an extra byte
+  static u32 match_cost(u32 size) {
+    if constexpr (format == SplitStreamFormat::yay0) {
+      return size >= 0x12 ? 25 : 17;
+    }
+    return 17;
+  }
+
+  void literal(u8 byte) {
+    chunks.push_back(byte);
+    mask |= bit;
+    next();
+  }
+
+  void match(u32 size, u32 dist) {
+    u32 count;
+    if constexpr (format == SplitStreamFormat::mio0) {
+      count = size - 3;
+    } else if (size >= 0x12) {
+      count = 0;
+      chunks.push_back(u8(size - 0x12));
+    } else {
+      count = size - 2;
+    }
+    links.push_back(u8(count << 4 | dist >> 8));
+    links.push_back(u8(dist));
+    next();
+  }
+
+  size_t finish(size_t src_size) {
+    if (bit != 0x80000000) {
+      W32(masks, mask);
+      masks += 4;
+    }
+
+    size_t link_offset = masks - dest;
+    size_t chunk_offset = link_offset + links.size();
+    size_t end = chunk_offset + chunks.size();
+    memcpy(dest + link_offset, links.data(), links.size());
+    memcpy(dest + chunk_offset, chunks.data(), chunks.size());
+
+    memcpy(dest, SplitStream<format>::magic, 4);
+    W32(dest + 4, u32(src_size));
+    W32(dest + 8, u32(link_offset));
+    W32(dest + 12, u32(chunk_offset));
+
+    size_t aligned_size = (end + 15) & ~size_t(15);
+    memset(dest + end, 0, aligned_size - end);
+    return aligned_size;
+  }
+
+ private:
+  void next() {
+    bit >>= 1;
+    if (!bit) {
+      W32(masks, mask);
+      masks += 4;
+      mask = 0;
+      bit = 0x80000000;
+    }
+  }
+
+  u8* dest;
+  u8* masks;
+  std::vector<u8>& links;
+  std::vector<u8>& chunks;
+  u32 mask = 0;
+  u32 bit = 0x80000000;
+};
+
+template <SplitStreamFormat stream>
+size_t Yay0Encoder::encode_streams(const u8* src, size_t src_size, u8* dest) {
+  SplitStreamWriter<stream> writer(dest, links, chunks);
+  u32 max_match = SplitStream<stream>::max_match;
+  bool complete;
+  if (level >= 2) {
+    if (!optimal) optimal.reset(new OptimalParser);
+    complete =
+        optimal->parse(*chain, src, 0, src_size, max_match, writer, cancel);
+  } else if (level == 1) {
+    complete = parse_lazy(*chain, src, 0, src_size, max_match, writer, cancel);
+  } else {
+    complete =
+        parse_greedy(*chain, src, 0, src_size, max_match, writer, cancel);
+  }
+  return complete ? writer.finish(src_size) : 0;
+}
+
+Yay0Encoder::Yay0Encoder(SplitStreamFormat format, int level)
+    : format(format), level(level) {}
+
+Yay0Encoder::~Yay0Encoder() {}
+
+size_t Yay0Encoder::encode(const u8* src, size_t src_size, u8* dest) {
+  if (src_size > YAZ0_MAX_SIZE) return 0;
+  if (!chain) chain.reset(new HashChain);
+  if (format == SplitStreamFormat::mio0) {
+    return encode_streams<SplitStreamFormat::mio0>(src, src_size, dest);
+  }
+  return encode_streams<SplitStreamFormat::yay0>(src, src_size, dest);
+}
+
+// length of the copy in link, taking the extra byte from chunks if needed
+template <SplitStreamFormat format>
+static inline u32 copy_size(u32 link, const u8*& chunks) {
+  if constexpr (format == SplitStreamFormat::mio0) {
+    return (link >> 12) + 3;
+  }
+  if (link >> 12) return (link >> 12) + 2;
+  return *chunks++ + 0x12;
+}
+
+template <SplitStreamFormat format>
+static bool decode_streams(const u8* src, size_t src_size, u8* dest,
+                           size_t dest_size) {
+  typedef SplitStream<format> Stream;
+  if (src_size < 16 || memcmp(src, Stream::magic, 4)) return false;
+  // each stream ends where the next one starts
+  size_t link_offset = U32(src + 8);
+  size_t chunk_offset = U32(src + 12);
+  if (link_offset < 16 || chunk_offset < link_offset ||
+      chunk_offset > src_size) {
+    return false;
+  }
+  const u8* masks = src + 16;
+  const u8* masks_end = src + link_offset;
+  const u8* links = masks_end;
+  const u8* links_end = src + chunk_offset;
+  const u8* chunks = links_end;
+  const u8* chunks_end = src + src_size;
+  u8* out = dest;
+  u8* out_end = dest + dest_size;
+
+  while (out < out_end) {
+    if (masks_end - masks < 4) return false;
+    u32 mask = U32(masks);
+    masks += 4;
+
+    // a word of 32 literals
+    if (mask == 0xFFFFFFFF && chunks_end - chunks >= 32 &&
+        out_end - out >= 32) {
+      memcpy(out, chunks, 32);
+      chunks += 32;
+      out += 32;
+      continue;
+    }
+
+    // with room for the largest possible word in every stream only the
+    // copy distance needs checking
+    if (links_end - links >= 32 * 2 && chunks_end - chunks >= 32 &&
+        out_end - out >= 32 * Stream::max_match) {
+      for (int bit = 0; bit < 32; bit++, mask <<= 1) {
+        if (mask & 0x80000000) {
+          *out++ = *chunks++;
+          continue;
+        }
+        u32 link = U16(links);
+        links += 2;
+        u32 dist = (link & 0xFFF) + 1;
+        u32 size = copy_size<format>(link, chunks);
+        if (dist > size_t(out - dest)) return false;
+        copy_match(out, dist, size, out_end);
+        out += size;
+      }
+      continue;
+    }
+
+    for (int bit = 0; bit < 32 && out < out_end; bit++, mask <<= 1) {
+      if (mask & 0x80000000) {
+        if (chunks >= chunks_end) return false;
+        *out++ = *chunks++;
+        continue;
+      }
+      if (links_end - links < 2) return false;
+      u32 link = U16(links);
+      links += 2;
+      u32 dist = (link & 0xFFF) + 1;
+      if (format == SplitStreamFormat::yay0 && !(link >> 12) &&
+          chunks >= chunks_end) {
+        return false;
+      }
+      u32 size = copy_size<format>(link, chunks);
+      if (dist > size_t(out - dest) || size > size_t(out_end - out)) {
+        return false;
+      }
+      copy_match(out, dist, size, out_end);
+      out += size;
+    }
+  }
+  return true;
+}
+
+bool yay0_decode(const u8* src, size_t src_size, u8* dest, size_t dest_size,
+                 SplitStreamFormat format) {
+  if (format == SplitStreamFormat::mio0) {
+    return decode_streams<SplitStreamFormat::mio0>(src, src_size, dest,
+                                                   dest_size);
+  }
+  return decode_streams<SplitStreamFormat::yay0>(src, src_size, dest,
+                                                 dest_size);
+}
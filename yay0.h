@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// bump whenever a change makes an encoder produce different bytes
+#define YAY0_ENCODER_VERSION 1
+#define MIO0_ENCODER_VERSION 1
+
+class HashChain;
+class OptimalParser;
+
+// Yay0 keeps the Yaz0 tokens, but in three streams: 32-bit words of code bits,
+// then 16-bit copies, then literals and the extra length bytes of long copies.
+// The header holds the decompressed size and the offsets of the last two.
+// MIO0, its predecessor, has the same layout, but copies are 3 to 18 bytes
+// long and never take an extra length byte.
+enum class SplitStreamFormat { yay0, mio0 };
+
+// Worst-case size of an encoded stream for src_size input bytes, including
+// the header and the alignment padding.
+size_t yay0_bound(size_t src_size);
+
+// Keeps its match tables and stream buffers between calls. Not thread safe.
+// The levels are those of Yaz0Encoder.
+class Yay0Encoder {
+ public:
+  explicit Yay0Encoder(SplitStreamFormat format = SplitStreamFormat::yay0,
+                       int level = 0);
+  ~Yay0Encoder();
+
+  // Encodes src into dest, which must hold yay0_bound(src_size) bytes, and
+  // returns the size of the padded stream, or 0 if src_size is larger than
+  // YAZ0_MAX_SIZE.
+  size_t encode(const uint8_t* src, size_t src_size, uint8_t* dest);
+  // as Yaz0Encoder::set_cancel
+  void set_cancel(const std::atomic<bool>* flag) { cancel = flag; }
+
+ private:
+  template <SplitStreamFormat stream>
+  size_t encode_streams(const uint8_t* src, size_t src_size, uint8_t* dest);
+
+  SplitStreamFormat format;
+  int level;
+  const std::atomic<bool>* cancel = nullptr;
+  std::unique_ptr<HashChain> chain;
+  std::unique_ptr<OptimalParser> optimal;
+  std::vector<uint8_t> links;
+  std::vector<uint8_t> chunks;
+};
+
+// Returns false instead of reading past src + src_size or writing past
+// dest + dest_size.
+bool yay0_decode(const uint8_t* src, size_t src_size, uint8_t* dest,
+                 size_t dest_size,
+                 SplitStreamFormat format = SplitStreamFormat::yay0);
@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <list>
-#include <unordered_map>
+#include <algorithm>
+
+#include "match.h"
+#include "parse.h"
 #include "readwrite.h"
 
 #include "yaz0.h"
@@ -12,39 +14,26 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 
-/* internal declarations */
-int yaz0_encode_internal(const u8* src, int srcSize, u8* Data);
-
-int yaz0_get_size(u8* src) { return U32(src + 0x4); }
-
-u32 toDWORD(u32 d) {
-  u8 w1 = d & 0xFF;
-  u8 w2 = (d >> 8) & 0xFF;
-  u8 w3 = (d >> 16) & 0xFF;
-  u8 w4 = d >> 24;
-  return (w1 << 24) | (w2 << 16) | (w3 << 8) | w4;
-}
-
 // simple and straight encoding scheme for Yaz0
-u32 longest_match_brute(const u8* src, int size, int pos, u32* pMatchPos) {
-  int startPos = pos - 0x1000;
-  int max_match_size = size - pos;
+u32 longest_match_brute(const u8* src, size_t size, size_t pos,
+                        size_t* pMatchPos) {
+  size_t startPos = pos > 0x1000 ? pos - 0x1000 : 0;
+  size_t max_match_size = size - pos;
   u32 best_match_size = 0;
-  u32 best_match_pos = 0;
+  size_t best_match_pos = 0;
 
   if (max_match_size < 3) return 0;
 
-  if (startPos < 0) startPos = 0;
-
   if (max_match_size > 0x111) max_match_size = 0x111;
 
-  for (int i = startPos; i < pos; i++) {
-    int current_size;
-    for (current_size = 0; current_size < max_match_size; current_size++) {
-      if (src[i + current_size] != src[pos + current_size]) {
-	break;
-      }
-    }
+  // only window positions sharing the first three bytes can beat a literal
+  u32 candidates[0x1000];
+  size_t count =
+      find_candidates(src + startPos, pos - startPos, src + pos, candidates);
+  for (size_t c = 0; c < count; c++) {
+    size_t i = startPos + candidates[c];
+    u32 current_size =
+        3 + match_length(src + i + 3, src + pos + 3, max_match_size - 3);
     if (current_size > best_match_size) {
       best_match_size = current_size;
       best_match_pos = i;
@@ -55,29 +44,24 @@ u32 longest_match_brute(const u8* src, int size, int pos, u32* pMatchPos) {
   return best_match_size;
 }
 
-u32 longest_match_rabinkarp(const u8* src, int size, int pos, u32* match_pos) {
-  int startPos = pos - 0x1000;
-  int max_match_size = size - pos;
+u32 longest_match_rabinkarp(const u8* src, size_t size, size_t pos,
+                            size_t* match_pos) {
+  size_t startPos = pos > 0x1000 ? pos - 0x1000 : 0;
+  size_t max_match_size = size - pos;
   u32 best_match_size = 0;
-  u32 best_match_pos = 0;
+  size_t best_match_pos = 0;
 
   if (max_match_size < 3) return 0;
 
-  if (startPos < 0) startPos = 0;
-
   if (max_match_size > 0x111) max_match_size = 0x111;
 
   int find_hash = src[pos] << 16 | src[pos + 1] << 8 | src[pos + 2];
   int current_hash = src[startPos] << 16 | src[startPos + 1] << 8 | src[startPos + 2];
 
-  for (int i = startPos; i < pos; i++) {
+  for (size_t i = startPos; i < pos; i++) {
     if(current_hash == find_hash) {
-      int current_size;
-      for (current_size = 3; current_size < max_match_size; current_size++) {
-        if (src[i + current_size] != src[pos + current_size]) {
-          break;
-        }
-      }
+      u32 current_size =
+          3 + match_length(src + i + 3, src + pos + 3, max_match_size - 3);
       if (current_size > best_match_size) {
         best_match_size = current_size;
         best_match_pos = i;
@@ -91,41 +75,66 @@ u32 longest_match_rabinkarp(const u8* src, int size, int pos, u32* match_pos) {
   return best_match_size;
 }
 
-int yaz0_encode_internal(const u8* src, int srcSize, u8* Data) {
-  int srcPos = 0;
+// gives the window scans above the same interface as HashChain
+template <u32 (*longest_match_fn)(const u8*, size_t, size_t, size_t*)>
+class WindowScan {
+ public:
+  void reset(const u8* new_src, size_t new_size) {
+    src = new_src;
+    size = new_size;
+  }
 
-  int bitmask = 0x80;
-  u8 currCodeByte = 0;
-  int currCodeBytePos = 0;
-  int pos = currCodeBytePos + 1;
-
-  while (srcPos < srcSize) {
-    u32 numBytes;
-    u32 matchPos;
-
-    numBytes = longest_match_rabinkarp(src, srcSize, srcPos, &matchPos);
-    //fprintf(stderr, "pos %x len %x pos %x\n", srcPos, (int)numBytes, (int)matchPos);
-    if (numBytes < 3) {
-      //fprintf(stderr, "single byte %02x\n", src[srcPos]);
-      Data[pos++] = src[srcPos++];
-      currCodeByte |= bitmask;
-    } else {
-      // RLE part
-      u32 dist = srcPos - matchPos - 1;
-
-      if (numBytes >= 0x12)  // 3 byte encoding
-      {
-        Data[pos++] = dist >> 8;    // 0R
-        Data[pos++] = dist & 0xFF;  // FF
-        if (numBytes > 0xFF + 0x12) numBytes = 0xFF + 0x12;
-        Data[pos++] = numBytes - 0x12;
-      } else  // 2 byte encoding
-      {
-        Data[pos++] = ((numBytes - 2) << 4) | (dist >> 8);
-        Data[pos++] = dist & 0xFF;
-      }
-      srcPos += numBytes;
+  void insert(size_t pos, size_t count) {}
+
+  // the scans always stop at 0x111, the Yaz0 limit
+  u32 longest_match(size_t pos, size_t max_len, size_t* match_pos) const {
+    return longest_match_fn(src, size, pos, match_pos);
+  }
+
+ private:
+  const u8* src = nullptr;
+  size_t size = 0;
+};
+
+// Writes tokens as Yaz0 code stream: a code byte for every eight tokens,
+// each followed by the literals and copies it describes
+class Yaz0Writer {
+ public:
+  explicit Yaz0Writer(u8* data) : Data(data) {}
+
+  // 2 bytes for copies up to 0x11 bytes, 3 for longer ones
+  static u32 match_cost(u32 size) { return size >= 0x12 ? 25 : 17; }
+
+  void literal(u8 byte) {
+    Data[pos++] = byte;
+    currCodeByte |= bitmask;
+    next();
+  }
+
+  void match(u32 numBytes, u32 dist) {
+    if (numBytes >= 0x12)  // 3 byte encoding
+    {
+      Data[pos++] = dist >> 8;    // 0R
+      Data[pos++] = dist & 0xFF;  // FF
+      if (numBytes > 0xFF + 0x12) numBytes = 0xFF + 0x12;
+      Data[pos++] = numBytes - 0x12;
+    } else  // 2 byte encoding
+    {
+      Data[pos++] = ((numBytes - 2) << 4) | (dist >> 8);
+      Data[pos++] = dist & 0xFF;
     }
+    next();
+  }
+
+  size_t finish() {
+    if (bitmask) {
+      Data[currCodeBytePos] = currCodeByte;
+    }
+    return pos;
+  }
+
+ private:
+  void next() {
     bitmask >>= 1;
     // write eight codes
     if (!bitmask) {
@@ -136,54 +145,190 @@ int yaz0_encode_internal(const u8* src, int srcSize, u8* Data) {
       bitmask = 0x80;
     }
   }
-  if (bitmask) {
-    Data[currCodeBytePos] = currCodeByte;
-  }
 
-  return pos;
+  u8* Data;
+  int bitmask = 0x80;
+  u8 currCodeByte = 0;
+  size_t currCodeBytePos = 0;
+  size_t pos = 1;
+};
+
+// one code byte per eight tokens, and a token never takes more bytes than it
+// decodes to
+size_t yaz0_segment_bound(size_t segment_size) {
+  return segment_size + segment_size / 8 + 1;
+}
+
+size_t yaz0_bound(size_t src_size) {
+  return 16 + yaz0_segment_bound(src_size) + 15;
+}
+
+bool yaz0_decoded_size(const u8* src, size_t src_size, size_t* size) {
+  if (src_size < 0x10 || memcmp(src, "Yaz0", 4)) return false;
+  *size = U32(src + 4);
+  return true;
+}
+
+// write the 16 bytes Yaz0 header and pad the stream to a multiple of 16
+static size_t yaz0_finish(u8* dst, size_t src_size, size_t dst_size) {
+  // write 4 bytes yaz0 header
+  memcpy(dst, "Yaz0", 4);
+
+  // write 4 bytes uncompressed size
+  W32(dst + 4, u32(src_size));
+  memset(dst + 8, 0, 8);
+
+  size_t aligned_size = (dst_size + 31) & ~size_t(15);
+  memset(dst + 16 + dst_size, 0, aligned_size - 16 - dst_size);
+  return aligned_size;
 }
 
-std::vector<uint8_t> yaz0_encode_fast(const u8* src, int src_size) {
-  std::vector<uint8_t> buffer;
-  std::vector<std::list<uint32_t>> lut;
-  lut.resize(0x1000000);
+Yaz0Encoder::Yaz0Encoder(Yaz0MatchFinder finder, int level)
+    : finder(finder), level(level) {}
 
-  for (int i = 0; i < src_size - 3; ++i) {
-    lut[src[i + 0] << 16 | src[i + 1] << 8 | src[i + 2]].push_back(i);
+Yaz0Encoder::~Yaz0Encoder() {}
+
+void Yaz0Encoder::reset() {
+  // moving base past the last window makes every entry stale; the optimal
+  // parser refills its tables for every block anyway
+  if (chain) chain->reset(nullptr, 0);
+}
+
+size_t Yaz0Encoder::encode_segment(const u8* src, size_t start, size_t end,
+                                   u8* dest) {
+  if (end > YAZ0_MAX_SIZE) return 0;
+  Yaz0Writer writer(dest);
+  bool complete;
+  if (level >= 2) {
+    if (!chain) chain.reset(new HashChain);
+    if (!optimal) optimal.reset(new OptimalParser);
+    complete = optimal->parse(*chain, src, start, end, 0x111, writer, cancel);
+  } else if (level == 1) {
+    if (!chain) chain.reset(new HashChain);
+    complete = parse_lazy(*chain, src, start, end, 0x111, writer, cancel);
+  } else {
+    switch (finder) {
+      case Yaz0MatchFinder::brute: {
+        WindowScan<longest_match_brute> scan;
+        complete = parse_greedy(scan, src, start, end, 0x111, writer, cancel);
+        break;
+      }
+      case Yaz0MatchFinder::rabinkarp: {
+        WindowScan<longest_match_rabinkarp> scan;
+        complete = parse_greedy(scan, src, start, end, 0x111, writer, cancel);
+        break;
+      }
+      default:
+        if (!chain) chain.reset(new HashChain);
+        complete =
+            parse_greedy(*chain, src, start, end, 0x111, writer, cancel);
+    }
   }
+  return complete ? writer.finish() : 0;
+}
 
+size_t Yaz0Encoder::encode(const u8* src, size_t src_size, u8* dest) {
+  if (src_size > YAZ0_MAX_SIZE) return 0;
+  size_t dst_size = encode_segment(src, 0, src_size, dest + 16);
+  // only a cancelled encode has nothing to show for its input
+  if (src_size && !dst_size) return 0;
+  return yaz0_finish(dest, src_size, dst_size);
+}
+
+std::vector<uint8_t> yaz0_encode(const u8* src, size_t src_size,
+                                 Yaz0MatchFinder finder) {
+  std::vector<uint8_t> buffer(yaz0_bound(src_size));
+  Yaz0Encoder encoder(finder);
+  buffer.resize(encoder.encode(src, src_size, buffer.data()));
   return buffer;
 }
 
-std::vector<uint8_t> yaz0_encode(const u8* src, int src_size) {
-  std::vector<uint8_t> buffer(src_size * 10 / 8 + 16);
-  u8* dst = buffer.data();
+std::vector<uint8_t> yaz0_encode_segment(const u8* src, size_t start,
+                                         size_t end) {
+  std::vector<uint8_t> buffer(yaz0_segment_bound(end - start));
+  Yaz0Encoder encoder;
+  buffer.resize(encoder.encode_segment(src, start, end, buffer.data()));
+  return buffer;
+}
 
-  // write 4 bytes yaz0 header
-  memcpy(dst, "Yaz0", 4);
+size_t yaz0_join_segments(const u8* const* segments,
+                          const size_t* segment_sizes, size_t count,
+                          u8* dest) {
+  size_t src_size = 0;
+  for (size_t i = 0; i < count; i++) src_size += segment_sizes[i];
+  u8* Data = dest + 16;
+
+  int bitmask = 0;
+  size_t currCodeBytePos = 0;
+  size_t pos = 0;
+
+  // every segment ends with a partial group whose unused code bits are zero,
+  // so walk the tokens and repack them into continuous groups of eight
+  for (size_t i = 0; i < count; i++) {
+    const u8* seg = segments[i];
+    size_t segPos = 0;
+    size_t decoded = 0;
+    u8 codeByte = 0;
+    int bitCount = 0;
+
+    while (decoded < segment_sizes[i]) {
+      if (!bitCount) {
+        codeByte = seg[segPos++];
+        bitCount = 8;
+      }
 
-  // write 4 bytes uncompressed size
-  W32(dst + 4, src_size);
-
-  // encode
-  int dst_size = yaz0_encode_internal(src, src_size, dst + 16);
-  int aligned_size = (dst_size + 31) & -16;
-  buffer.resize(aligned_size);
-
-#if 0
-  std::vector<uint8_t> decompressed(src_size);
-  yaz0_decode(buffer.data(), decompressed.data(), src_size);
-  if(memcmp(src, decompressed.data(), src_size)) {
-    fprintf(stderr, "Decompressed buffer is different from original\n");
+      if (!bitmask) {
+        currCodeBytePos = pos++;
+        Data[currCodeBytePos] = 0;
+        bitmask = 0x80;
+      }
+
+      if (codeByte & 0x80) {
+        Data[currCodeBytePos] |= bitmask;
+        Data[pos++] = seg[segPos++];
+        decoded++;
+      } else {
+        u8 byte1 = seg[segPos++];
+        u8 byte2 = seg[segPos++];
+        Data[pos++] = byte1;
+        Data[pos++] = byte2;
+        if (byte1 >> 4) {
+          decoded += (byte1 >> 4) + 2;
+        } else {
+          u8 byte3 = seg[segPos++];
+          Data[pos++] = byte3;
+          decoded += byte3 + 0x12;
+        }
+      }
+
+      codeByte <<= 1;
+      bitCount--;
+      bitmask >>= 1;
+    }
   }
-#endif
 
+  return yaz0_finish(dest, src_size, pos);
+}
+
+std::vector<uint8_t> yaz0_join_segments(
+    const std::vector<std::vector<uint8_t>>& segments,
+    const std::vector<size_t>& segment_sizes) {
+  size_t src_size = 0;
+  std::vector<const u8*> data;
+  for (size_t i = 0; i < segments.size(); i++) {
+    src_size += segment_sizes[i];
+    data.push_back(segments[i].data());
+  }
+  std::vector<uint8_t> buffer(yaz0_bound(src_size));
+  buffer.resize(yaz0_join_segments(data.data(), segment_sizes.data(),
+                                   segments.size(), buffer.data()));
   return buffer;
 }
 
-void yaz0_decode(const uint8_t* source, uint8_t* decomp, int32_t decompSize) {
-  uint32_t srcPlace = 0, dstPlace = 0;
-  uint32_t i, dist, copyPlace, numBytes;
+void yaz0_decode(const uint8_t* source, uint8_t* decomp, size_t decompSize) {
+  size_t srcPlace = 0, dstPlace = 0;
+  size_t copyPlace;
+  uint32_t i, dist, numBytes;
   uint8_t codeByte, byte1, byte2;
   uint8_t bitCount = 0;
 
@@ -226,3 +371,180 @@ void yaz0_decode(const uint8_t* source, uint8_t* decomp, int32_t decompSize) {
     bitCount--;
   }
 }
+
+bool yaz0_decode_checked(const u8* src, size_t src_size, u8* dest,
+                         size_t dest_size) {
+  if (src_size < 0x10) return false;
+
+  const u8* in = src + 0x10;
+  const u8* in_end = src + src_size;
+  u8* out = dest;
+  u8* out_end = dest + dest_size;
+
+  while (out < out_end) {
+    if (in >= in_end) return false;
+    u8 codeByte = *in++;
+
+    // a group of eight literals
+    if (codeByte == 0xFF && in_end - in >= 8 && out_end - out >= 8) {
+      memcpy(out, in, 8);
+      in += 8;
+      out += 8;
+      continue;
+    }
+
+    // with room for the largest possible group on both sides only the match
+    // distance needs checking
+    if (in_end - in >= 8 * 3 && out_end - out >= 8 * 0x111) {
+      for (int bit = 0; bit < 8; bit++, codeByte <<= 1) {
+        if (codeByte & 0x80) {
+          *out++ = *in++;
+          continue;
+        }
+
+        u32 byte1 = in[0];
+        u32 dist = (((byte1 & 0xF) << 8) | in[1]) + 1;
+        u32 numBytes = byte1 >> 4;
+        in += 2;
+        if (!numBytes) {
+          numBytes = *in++ + 0x12;
+        } else {
+          numBytes += 2;
+        }
+
+        if (dist > size_t(out - dest)) return false;
+        copy_match(out, dist, numBytes, out_end);
+        out += numBytes;
+      }
+      continue;
+    }
+
+    for (int bit = 0; bit < 8 && out < out_end; bit++, codeByte <<= 1) {
+      if (codeByte & 0x80) {
+        if (in >= in_end) return false;
+        *out++ = *in++;
+        continue;
+      }
+
+      if (in_end - in < 2) return false;
+      u32 byte1 = in[0];
+      u32 dist = (((byte1 & 0xF) << 8) | in[1]) + 1;
+      u32 numBytes = byte1 >> 4;
+      in += 2;
+      if (!numBytes) {
+        if (in >= in_end) return false;
+        numBytes = *in++ + 0x12;
+      } else {
+        numBytes += 2;
+      }
+
+      if (dist > size_t(out - dest) || numBytes > size_t(out_end - out)) {
+        return false;
+      }
+      copy_match(out, dist, numBytes, out_end);
+      out += numBytes;
+    }
+  }
+
+  return true;
+}
+
+#define RING_SIZE sizeof(Yaz0Decoder::ring)
+#define RING_MASK (RING_SIZE - 1)
+
+Yaz0Decoder::Yaz0Decoder() { reset(); }
+
+void Yaz0Decoder::reset() {
+  header_size = 0;
+  total = 0;
+  written = 0;
+  failed = false;
+  code_byte = 0;
+  bit_count = 0;
+  token_size = 0;
+  flushed = 0;
+}
+
+bool Yaz0Decoder::finished() const {
+  return header_size == 16 && written == total;
+}
+
+void Yaz0Decoder::flush(const Sink& sink) {
+  if (written == flushed) return;
+  sink(ring + (flushed & RING_MASK), written - flushed);
+  flushed = written;
+}
+
+bool Yaz0Decoder::feed(const u8* data, size_t size, const Sink& sink) {
+  if (failed) return false;
+
+  const u8* in = data;
+  const u8* in_end = data + size;
+
+  while (in < in_end && header_size < 16) {
+    header[header_size++] = *in++;
+    if (header_size == 16) {
+      if (!yaz0_decoded_size(header, 16, &total)) {
+        failed = true;
+        return false;
+      }
+    }
+  }
+
+  while (in < in_end && written < total) {
+    if (!bit_count) {
+      code_byte = *in++;
+      bit_count = 8;
+
+      // a group of eight literals
+      size_t to = written & RING_MASK;
+      if (code_byte == 0xFF && in_end - in >= 8 && total - written >= 8 &&
+          RING_SIZE - to >= 8) {
+        memcpy(ring + to, in, 8);
+        in += 8;
+        written += 8;
+        bit_count = 0;
+        if (!(written & RING_MASK)) flush(sink);
+      }
+      continue;
+    }
+
+    if (code_byte & 0x80) {
+      ring[written++ & RING_MASK] = *in++;
+      if (!(written & RING_MASK)) flush(sink);
+    } else {
+      // a match may be split across chunks
+      token[token_size++] = *in++;
+      if (token_size < 2 || (token_size == 2 && !(token[0] >> 4))) continue;
+      token_size = 0;
+
+      size_t dist = (((token[0] & 0xF) << 8) | token[1]) + 1;
+      size_t n = token[0] >> 4 ? (token[0] >> 4) + 2 : token[2] + 0x12;
+      if (dist > written || n > total - written) {
+        failed = true;
+        return false;
+      }
+
+      // copy in runs that are contiguous in the ring on both sides
+      while (n) {
+        size_t to = written & RING_MASK;
+        size_t from = (written - dist) & RING_MASK;
+        size_t chunk = std::min(n, RING_SIZE - std::max(to, from));
+        if (dist >= chunk) {
+          memmove(ring + to, ring + from, chunk);
+        } else {
+          for (size_t i = 0; i < chunk; i++) ring[to + i] = ring[from + i];
+        }
+        written += chunk;
+        n -= chunk;
+        if (!(written & RING_MASK)) flush(sink);
+      }
+    }
+
+    code_byte <<= 1;
+    bit_count--;
+  }
+
+  flush(sink);
+  return true;
+}
@@ -1,6 +1,130 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <vector>
 
-void yaz0_decode(const uint8_t* src, uint8_t* dest, int32_t destsize);
-std::vector<uint8_t> yaz0_encode(const uint8_t* src, int src_size);
+// bump whenever a change makes the encoder produce different bytes
+#define YAZ0_ENCODER_VERSION 1
+
+// largest input the encoder accepts; the header could store up to 4 GB, but
+// the match tables keep positions in 32 bits
+#define YAZ0_MAX_SIZE 0x80000000u
+
+enum class Yaz0MatchFinder {
+  brute,      // compares every window position
+  rabinkarp,  // rolls a 3-byte hash over every window position
+  hash_chain  // visits only positions with the same 3-byte hash
+};
+
+// Worst-case size of an encoded stream for src_size input bytes, including
+// the header and the alignment padding.
+size_t yaz0_bound(size_t src_size);
+// Worst-case size of a headerless segment of segment_size input bytes.
+size_t yaz0_segment_bound(size_t segment_size);
+// Reads the decompressed size from a Yaz0 header; false if src does not start
+// with one.
+bool yaz0_decoded_size(const uint8_t* src, size_t src_size, size_t* size);
+
+class HashChain;
+class OptimalParser;
+
+// Keeps its match tables between calls, so encoding many files with one
+// encoder only allocates once. Not thread safe; use one encoder per thread.
+//
+// level 0 takes the longest match at every position, 1 looks up to two bytes
+// ahead for a longer one and 2 finds the smallest encoding the match finder
+// allows. Levels above 0 always use the hash chain.
+class Yaz0Encoder {
+ public:
+  explicit Yaz0Encoder(Yaz0MatchFinder finder = Yaz0MatchFinder::hash_chain,
+                       int level = 0);
+  ~Yaz0Encoder();
+
+  // Encodes src into dest, which must hold yaz0_bound(src_size) bytes, and
+  // returns the size of the padded stream, or 0 if src_size is larger than
+  // YAZ0_MAX_SIZE.
+  size_t encode(const uint8_t* src, size_t src_size, uint8_t* dest);
+  // Encodes src[start, end) as a headerless code stream into dest, which must
+  // hold yaz0_segment_bound(end - start) bytes. Up to 0x1000 bytes before
+  // start are used as match history, so consecutive segments of one file can
+  // be encoded independently and then joined with yaz0_join_segments.
+  size_t encode_segment(const uint8_t* src, size_t start, size_t end,
+                        uint8_t* dest);
+  // Makes encode and encode_segment stop early and return 0 once *flag turns
+  // true, until set back to null.
+  void set_cancel(const std::atomic<bool>* flag) { cancel = flag; }
+  // Forgets the previous input, so nothing of it is matched against again.
+  // The tables stay allocated for the next call.
+  void reset();
+
+ private:
+  Yaz0MatchFinder finder;
+  int level;
+  const std::atomic<bool>* cancel = nullptr;
+  std::unique_ptr<HashChain> chain;
+  std::unique_ptr<OptimalParser> optimal;
+};
+
+// Decodes a stream that arrives in chunks of any size. Output is produced
+// through a 4 KB ring, the size of the match window, and handed to the sink
+// whenever the ring fills and at the end of every feed call.
+class Yaz0Decoder {
+ public:
+  typedef std::function<void(const uint8_t* data, size_t size)> Sink;
+
+  Yaz0Decoder();
+  // Forgets the current stream so the decoder can start on the next one.
+  void reset();
+  // Decodes the next chunk of the stream, header included. Returns false if
+  // the stream is corrupt; bytes after the end of the stream, like the
+  // alignment padding, are ignored.
+  bool feed(const uint8_t* data, size_t size, const Sink& sink);
+  // True once the header has been read and all of its bytes were produced.
+  bool finished() const;
+  // Decompressed size from the header, 0 until the header has been read.
+  size_t size() const { return header_size == 16 ? total : 0; }
+  size_t produced() const { return written; }
+
+ private:
+  void flush(const Sink& sink);
+
+  uint8_t header[16];
+  size_t header_size;
+  size_t total;
+  size_t written;
+  bool failed;
+
+  uint8_t code_byte;
+  int bit_count;
+  uint8_t token[3];
+  int token_size;
+
+  uint8_t ring[0x1000];
+  size_t flushed;
+};
+
+void yaz0_decode(const uint8_t* src, uint8_t* dest, size_t dest_size);
+// Same output as yaz0_decode, but faster and safe on untrusted input: returns
+// false instead of reading past src + src_size or writing past
+// dest + dest_size.
+bool yaz0_decode_checked(const uint8_t* src, size_t src_size, uint8_t* dest,
+                         size_t dest_size);
+
+// Convenience wrappers that allocate the output
+std::vector<uint8_t> yaz0_encode(
+    const uint8_t* src, size_t src_size,
+    Yaz0MatchFinder finder = Yaz0MatchFinder::hash_chain);
+std::vector<uint8_t> yaz0_encode_segment(const uint8_t* src, size_t start,
+                                         size_t end);
+std::vector<uint8_t> yaz0_join_segments(
+    const std::vector<std::vector<uint8_t>>& segments,
+    const std::vector<size_t>& segment_sizes);
+// Joins count segments into dest, which must hold yaz0_bound of their summed
+// sizes, and returns the size of the padded stream.
+size_t yaz0_join_segments(const uint8_t* const* segments,
+                          const size_t* segment_sizes, size_t count,
+                          uint8_t* dest);